@@ -0,0 +1,132 @@
+/**
+ * Benchmarks for the subprocess library.
+ * Compares round trips through /bin/cat over plain pipes (default and enlarged
+ * capacity) with a SharedRing pair to a cooperating child (this binary, re-executed),
+ * and the line round trip latency of a stdio buffered child over pipes and a pty.
+ */
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "subprocess.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+const size_t TOTAL_BYTES = 256 << 20;
+const size_t LINE_LENGTH = 4096;
+const size_t LATENCY_ROUND_TRIPS = 1000;
+
+double mibPerSecond(size_t bytes, Clock::duration elapsed) {
+    return (bytes / double(1 << 20)) / std::chrono::duration<double>(elapsed).count();
+}
+
+/* echo everything from the BENCH_IN ring into the BENCH_OUT ring */
+int ringEchoChild() {
+    subprocess::internal::SharedRing in = subprocess::internal::SharedRing::fromEnvironment("BENCH_IN");
+    subprocess::internal::SharedRing out = subprocess::internal::SharedRing::fromEnvironment("BENCH_OUT");
+    if (!in.isValid() || !out.isValid()) return 1;
+    std::vector<char> buf(1 << 16);
+    size_t n;
+    while ((n = in.read(buf.data(), buf.size())) > 0) {
+        out.write(buf.data(), n);
+    }
+    out.closeWriter();
+    return 0;
+}
+
+double benchPipe(size_t capacity) {
+    subprocess::internal::Process proc;
+    proc.setPipeCapacity(capacity, capacity);
+    std::vector<std::string> args;
+    proc.start("/bin/cat", args.begin(), args.end());
+
+    std::string line(LINE_LENGTH - 1, 'x');
+    line += '\n';
+    auto start = Clock::now();
+    std::thread writer([&]() {
+        for (size_t sent = 0; sent < TOTAL_BYTES; sent += line.size()) proc.write(line);
+        proc.sendEOF();
+    });
+    size_t received = 0;
+    std::string out;
+    while ((out = proc.readLine()).size() > 0) received += out.size();
+    auto elapsed = Clock::now() - start;
+    writer.join();
+    proc.waitUntilFinished();
+    return mibPerSecond(received, elapsed);
+}
+
+double benchRing(size_t capacity) {
+    subprocess::internal::SharedRing in = subprocess::internal::SharedRing::create(capacity);
+    subprocess::internal::SharedRing out = subprocess::internal::SharedRing::create(capacity);
+    subprocess::internal::Process proc;
+    proc.shareRing("BENCH_IN", in);
+    proc.shareRing("BENCH_OUT", out);
+    std::vector<std::string> args = {"--ring-echo"};
+    proc.start("/proc/self/exe", args.begin(), args.end());
+
+    std::vector<char> chunk(LINE_LENGTH, 'x');
+    auto start = Clock::now();
+    std::thread writer([&]() {
+        for (size_t sent = 0; sent < TOTAL_BYTES; sent += chunk.size()) in.write(chunk.data(), chunk.size());
+        in.closeWriter();
+    });
+    std::vector<char> buf(1 << 16);
+    size_t received = 0;
+    size_t n;
+    while ((n = out.read(buf.data(), buf.size())) > 0) received += n;
+    auto elapsed = Clock::now() - start;
+    writer.join();
+    proc.waitUntilFinished();
+    return mibPerSecond(received, elapsed);
+}
+
+/* ping pong single lines through grep, which buffers its output according to isatty */
+void benchLineLatency(subprocess::StdioMode mode, const std::string& name) {
+    subprocess::internal::Process proc;
+    proc.setStdioMode(mode);
+    std::vector<std::string> args = {""};
+    proc.start("/bin/grep", args.begin(), args.end());
+
+    size_t answered = 0;
+    Clock::duration total(0);
+    for (size_t i = 0; i < LATENCY_ROUND_TRIPS; ++i) {
+        auto start = Clock::now();
+        proc.write("ping " + std::to_string(i) + "\n");
+        if (proc.readLine(std::chrono::duration<double>(0.1)).empty()) {
+            break;
+        }
+        total += Clock::now() - start;
+        answered++;
+    }
+    proc.sendEOF();
+    // drain anything that was held back in the child's buffer
+    while (proc.readLine().size() > 0) {
+    }
+    proc.waitUntilFinished();
+
+    std::cout << name << answered << "/" << LATENCY_ROUND_TRIPS << " lines answered within 100 ms";
+    if (answered > 0) {
+        std::cout << ", mean " << std::chrono::duration<double, std::micro>(total).count() / answered << " us";
+    }
+    std::cout << std::endl;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "--ring-echo") {
+        return ringEchoChild();
+    }
+
+    std::cout << "round trip of " << (TOTAL_BYTES >> 20) << " MiB through a child" << std::endl;
+    std::cout << "pipe, default capacity:  " << benchPipe(0) << " MiB/s" << std::endl;
+    std::cout << "pipe, 1 MiB capacity:    " << benchPipe(subprocess::internal::BULK_PIPE_CAPACITY) << " MiB/s"
+              << std::endl;
+    std::cout << "shared ring, 1 MiB:      " << benchRing(1 << 20) << " MiB/s" << std::endl;
+    std::cout << "shared ring, 16 MiB:     " << benchRing(16 << 20) << " MiB/s" << std::endl;
+
+    std::cout << "line round trip latency through grep" << std::endl;
+    benchLineLatency(subprocess::StdioMode::Pipe, "pipe: ");
+    benchLineLatency(subprocess::StdioMode::Pty, "pty:  ");
+}
@@ -1,26 +1,463 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <functional>
 #include <future>
 #include <iostream>
+#include <limits>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <system_error>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
+// from_chars is used for record parsing where available
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#define SUBPROCESSCPP_HAS_FROM_CHARS 1
+#include <charconv>
+#endif
+#endif
+
 // unix process stuff
+#include <cctype>
+#include <cerrno>
 #include <cstring>
+#include <fcntl.h>
+#include <locale.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <termios.h>
 #include <unistd.h>
 
+// the awaitable interface needs C++20 coroutines, everything else is C++11
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define SUBPROCESSCPP_HAS_COROUTINES 1
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#endif
+#endif
+
 namespace subprocess {
+/**
+ * How the child's stdout and stderr are connected to us. stdin is always a
+ * pipe, so that sendEOF keeps working.
+ * */
+enum class StdioMode {
+    // plain pipes, libc in the child will fully buffer its output
+    Pipe,
+    // a pseudo-terminal in raw mode, so the child line buffers its output
+    Pty,
+};
+
+namespace internal {
+/**
+ * What a TraceEvent records. Spawn, Exec, Read, Write, Poll and Wait are
+ * spans, the rest are instants.
+ * */
+enum class TraceEventType : uint8_t {
+    // fork, from before the call to its return in the parent
+    Spawn,
+    // from fork returning until the child's exec succeeded
+    Exec,
+    // from fork returning until the child's exec failed, value is the errno
+    ExecFailed,
+    // the first bytes of output arrived
+    FirstByte,
+    // a read or write call, value is the number of bytes
+    Read,
+    Write,
+    // the parent blocked waiting for output
+    Poll,
+    // the child's output was closed
+    Eof,
+    // the parent blocked in waitpid until the child was reaped
+    Wait,
+    // the child was reaped, value is the exit status
+    Exit,
+};
+
+struct TraceEvent {
+    // nanoseconds on the steady clock
+    int64_t start;
+    int64_t duration;
+    pid_t child;
+    TraceEventType type;
+    int64_t value;
+    // numbers the threads that recorded events, in the order they started tracing
+    unsigned thread;
+};
+
+/**
+ * A ring of events, written only by the thread that currently owns it. Storage
+ * is allocated in chunks as it fills, so threads that only trace a few children
+ * stay cheap. Once full the oldest events are overwritten.
+ * Slots are read while they may be being written, seqlock style: every field is
+ * a relaxed atomic, and snapshot drops anything the writer could have touched.
+ * */
+class TraceBuffer {
+    struct Slot {
+        std::atomic<int64_t> start;
+        std::atomic<int64_t> duration;
+        std::atomic<int64_t> value;
+        // child pid in the low 32 bits, then the type, then the thread
+        std::atomic<uint64_t> packed;
+    };
+
+    static const size_t CHUNK_SIZE = 256;
+    std::vector<std::unique_ptr<Slot[]>> chunks;
+    std::atomic<uint64_t> written;
+    // events before this index were cleared
+    std::atomic<uint64_t> floor;
+    size_t capacity;
+
+public:
+    explicit TraceBuffer(size_t eventCapacity)
+            : chunks((std::max<size_t>(eventCapacity, 1) + CHUNK_SIZE - 1) / CHUNK_SIZE),
+              written(0),
+              floor(0),
+              capacity(chunks.size() * CHUNK_SIZE) {}
+
+    void push(const TraceEvent& event) {
+        uint64_t index = written.load(std::memory_order_relaxed);
+        size_t slot = index % capacity;
+        std::unique_ptr<Slot[]>& chunk = chunks[slot / CHUNK_SIZE];
+        if (!chunk) chunk.reset(new Slot[CHUNK_SIZE]);
+        Slot& target = chunk[slot % CHUNK_SIZE];
+        // the writer half of a seqlock: a snapshot that sees any of the stores
+        // below also sees written >= index, so knows this slot is suspect
+        std::atomic_thread_fence(std::memory_order_release);
+        target.start.store(event.start, std::memory_order_relaxed);
+        target.duration.store(event.duration, std::memory_order_relaxed);
+        target.value.store(event.value, std::memory_order_relaxed);
+        target.packed.store(static_cast<uint32_t>(event.child) | static_cast<uint64_t>(event.type) << 32 |
+                                    static_cast<uint64_t>(event.thread) << 40,
+                std::memory_order_relaxed);
+        // publishes the event (and its chunk) to snapshot
+        written.store(index + 1, std::memory_order_release);
+    }
+
+    /**
+     * appends the buffered events to out, dropping any that the owning
+     * thread may have been overwriting while they were copied
+     * */
+    void snapshot(std::vector<TraceEvent>& out) const {
+        uint64_t end = written.load(std::memory_order_acquire);
+        uint64_t begin = std::max<uint64_t>(end > capacity ? end - capacity : 0, floor.load());
+        size_t firstCopied = out.size();
+        for (uint64_t index = begin; index < end; ++index) {
+            size_t slot = index % capacity;
+            const Slot& source = chunks[slot / CHUNK_SIZE][slot % CHUNK_SIZE];
+            uint64_t packed = source.packed.load(std::memory_order_relaxed);
+            out.push_back({source.start.load(std::memory_order_relaxed),
+                    source.duration.load(std::memory_order_relaxed), static_cast<pid_t>(packed & 0xffffffff),
+                    static_cast<TraceEventType>((packed >> 32) & 0xff),
+                    source.value.load(std::memory_order_relaxed), static_cast<unsigned>(packed >> 40)});
+        }
+        // the copies above must be complete before we check what was overwritten
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = written.load(std::memory_order_relaxed);
+        // the writer stores index `after` before publishing it, so its slot is suspect too
+        if (after + 1 > capacity && after + 1 - capacity > begin) {
+            size_t overwritten = std::min<uint64_t>(after + 1 - capacity - begin, end - begin);
+            out.erase(out.begin() + firstCopied, out.begin() + firstCopied + overwritten);
+        }
+    }
+
+    /**
+     * forgets every event recorded so far
+     * */
+    void clear() {
+        floor.store(written.load());
+    }
+};
+
+struct TraceRegistry {
+    std::atomic<bool> enabled{false};
+    std::atomic<size_t> eventsPerThread{65536};
+    std::mutex mutex;
+    // every buffer with events, including ones whose threads have exited, so
+    // children run through async can still be exported
+    std::vector<std::shared_ptr<TraceBuffer>> buffers;
+    // buffers whose threads have exited, handed to the next thread that traces
+    std::vector<std::shared_ptr<TraceBuffer>> freeBuffers;
+    unsigned nextThread = 0;
+};
+
+inline TraceRegistry& traceRegistry() {
+    static TraceRegistry registry;
+    return registry;
+}
+
+/**
+ * a thread's claim on a TraceBuffer, which goes back to the free list when the
+ * thread exits, so memory stays bounded by the number of concurrent threads
+ * */
+struct TraceBufferLease {
+    std::shared_ptr<TraceBuffer> buffer;
+    unsigned thread = 0;
+
+    TraceBuffer& acquire() {
+        if (!buffer) {
+            TraceRegistry& registry = traceRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            if (!registry.freeBuffers.empty()) {
+                buffer = std::move(registry.freeBuffers.back());
+                registry.freeBuffers.pop_back();
+            } else {
+                buffer = std::make_shared<TraceBuffer>(registry.eventsPerThread.load());
+                registry.buffers.push_back(buffer);
+            }
+            thread = registry.nextThread++;
+        }
+        return *buffer;
+    }
+
+    ~TraceBufferLease() {
+        if (buffer) {
+            TraceRegistry& registry = traceRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.freeBuffers.push_back(std::move(buffer));
+        }
+    }
+};
+
+/**
+ * @return whether lifecycle events should be recorded, compiled out entirely
+ * when SUBPROCESSCPP_NO_TRACE is defined
+ * */
+inline bool tracing() {
+#ifdef SUBPROCESSCPP_NO_TRACE
+    return false;
+#else
+    return traceRegistry().enabled.load(std::memory_order_relaxed);
+#endif
+}
+
+inline int64_t traceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+/**
+ * records an event into the calling thread's buffer, claiming one first if needed
+ * */
+inline void traceRecord(TraceEventType type, pid_t child, int64_t start, int64_t duration = 0, int64_t value = 0) {
+    thread_local TraceBufferLease lease;
+    TraceBuffer& buffer = lease.acquire();
+    buffer.push({start, duration, child, type, value, lease.thread});
+}
+
+/**
+ * writes nanoseconds as the fractional microseconds the trace event format uses
+ * */
+inline void writeTraceMicros(std::ostream& out, int64_t nanos) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld.%03lld", static_cast<long long>(nanos / 1000),
+            static_cast<long long>(nanos % 1000));
+    out << buf;
+}
+}
+
+/**
+ * Opt-in recording of process lifecycle events (spawn, exec, reads, writes,
+ * EOF, exit and reap), exportable for chrome://tracing or Perfetto.
+ * Recording costs one relaxed atomic load per operation while disabled, and
+ * can be compiled out with SUBPROCESSCPP_NO_TRACE.
+ * */
+namespace trace {
+/**
+ * starts recording events
+ * @param eventsPerThread - how many events each thread keeps before the
+ * oldest are overwritten, applies to threads that haven't traced anything yet
+ * */
+inline void enable(size_t eventsPerThread = 65536) {
+    internal::traceRegistry().eventsPerThread.store(eventsPerThread);
+    internal::traceRegistry().enabled.store(true);
+}
+
+inline void disable() {
+    internal::traceRegistry().enabled.store(false);
+}
+
+inline bool isEnabled() {
+    return internal::tracing();
+}
+
+/**
+ * forgets every event recorded so far, and frees the buffers of threads that
+ * have exited
+ * */
+inline void clear() {
+    internal::TraceRegistry& registry = internal::traceRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (const std::shared_ptr<internal::TraceBuffer>& buffer : registry.buffers) {
+        buffer->clear();
+    }
+    for (const std::shared_ptr<internal::TraceBuffer>& buffer : registry.freeBuffers) {
+        registry.buffers.erase(std::find(registry.buffers.begin(), registry.buffers.end(), buffer));
+    }
+    registry.freeBuffers.clear();
+}
+
+/**
+ * writes every recorded event as Chrome trace event JSON, with one track per
+ * child process. Events recorded while this runs may be missing.
+ * */
+inline void writeChromeTrace(std::ostream& out) {
+    static const char* const names[] = {
+            "spawn", "exec", "exec failed", "first byte", "read", "write", "poll", "eof", "wait", "exit"};
+    static const char* const valueNames[] = {
+            nullptr, nullptr, "errno", nullptr, "bytes", "bytes", nullptr, nullptr, nullptr, "status"};
+
+    internal::TraceRegistry& registry = internal::traceRegistry();
+    std::vector<internal::TraceEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (const std::shared_ptr<internal::TraceBuffer>& buffer : registry.buffers) {
+            buffer->snapshot(events);
+        }
+    }
+
+    const pid_t parent = getpid();
+    std::vector<pid_t> children;
+    bool first = true;
+    out << "{\"traceEvents\":[";
+    for (const internal::TraceEvent& event : events) {
+        size_t type = static_cast<size_t>(event.type);
+        bool isSpan = event.type == internal::TraceEventType::Spawn ||
+                      event.type == internal::TraceEventType::Exec ||
+                      event.type == internal::TraceEventType::ExecFailed ||
+                      event.type == internal::TraceEventType::Read ||
+                      event.type == internal::TraceEventType::Write ||
+                      event.type == internal::TraceEventType::Poll ||
+                      event.type == internal::TraceEventType::Wait;
+        out << (first ? "\n" : ",\n") << "{\"name\":\"" << names[type] << "\",\"ph\":\""
+            << (isSpan ? "X" : "i") << "\",\"ts\":";
+        internal::writeTraceMicros(out, event.start);
+        if (isSpan) {
+            out << ",\"dur\":";
+            internal::writeTraceMicros(out, event.duration);
+        } else {
+            out << ",\"s\":\"t\"";
+        }
+        out << ",\"pid\":" << parent << ",\"tid\":" << event.child << ",\"args\":{\"thread\":" << event.thread;
+        if (valueNames[type] != nullptr) {
+            out << ",\"" << valueNames[type] << "\":" << event.value;
+        }
+        out << "}}";
+        first = false;
+        children.push_back(event.child);
+    }
+
+    // name each child's track after it
+    std::sort(children.begin(), children.end());
+    children.erase(std::unique(children.begin(), children.end()), children.end());
+    for (pid_t child : children) {
+        out << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << parent
+            << ",\"tid\":" << child << ",\"args\":{\"name\":\"child " << child << "\"}}";
+        first = false;
+    }
+    out << "\n]}\n";
+}
+}
+
 namespace internal {
+// how many bytes we try to pull out of a pipe with each read call
+const size_t READ_CHUNK_SIZE = 16384;
+// a pipe capacity worth opting into with Process::setPipeCapacity when streaming
+// bulk data through a child, it counts against the per-user pipe-user-pages-soft limit
+const size_t BULK_PIPE_CAPACITY = 1 << 20;
+
+/**
+ * writes to a descriptor with SIGPIPE blocked, so that writing to a child that
+ * has exited fails with EPIPE rather than killing the whole process
+ * @return as for write(2)
+ * */
+inline ssize_t writeWithoutSigpipe(int fd, const void* buf, size_t len) {
+    sigset_t pipeSignal, oldMask, pending;
+    sigemptyset(&pipeSignal);
+    sigaddset(&pipeSignal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSignal, &oldMask);
+    // a SIGPIPE that was already pending belongs to someone else, leave it be
+    sigpending(&pending);
+    bool wasPending = sigismember(&pending, SIGPIPE);
+
+    ssize_t n = write(fd, buf, len);
+    int writeErrno = errno;
+    if (n < 0 && writeErrno == EPIPE && !wasPending) {
+        // consume the SIGPIPE our write raised before unblocking it
+        struct timespec noWait = {0, 0};
+        while (sigtimedwait(&pipeSignal, nullptr, &noWait) < 0 && errno == EINTR) {
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
+    errno = writeErrno;
+    return n;
+}
+
+/**
+ * reads the largest capacity an unprivileged process may give a pipe
+ * @return the value of /proc/sys/fs/pipe-max-size, or 0 if it is unknown
+ * */
+inline size_t maxPipeCapacity() {
+    static const size_t cached = []() -> size_t {
+        int fd = open("/proc/sys/fs/pipe-max-size", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return 0;
+        char buf[32] = {0};
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0) return 0;
+        return std::strtoul(buf, nullptr, 10);
+    }();
+    return cached;
+}
+
+/**
+ * grows the kernel buffer of a pipe, clamped to the system maximum.
+ * This is best effort, pipes are never shrunk and a failure (e.g. the per-user
+ * pipe page limit being hit) leaves the pipe at its current size.
+ * @param fd - either end of the pipe
+ * @param capacity - the requested capacity in bytes, 0 does nothing
+ * @return the capacity of the pipe after the call
+ * */
+inline size_t setPipeCapacity(int fd, size_t capacity) {
+#ifdef F_SETPIPE_SZ
+    int current = fcntl(fd, F_GETPIPE_SZ);
+    if (capacity == 0 || current < 0 || capacity <= static_cast<size_t>(current)) {
+        return current < 0 ? 0 : current;
+    }
+    size_t maxCapacity = maxPipeCapacity();
+    if (maxCapacity != 0) capacity = std::min(capacity, maxCapacity);
+    int res = fcntl(fd, F_SETPIPE_SZ, static_cast<int>(capacity));
+    return res < 0 ? current : res;
+#else
+    (void)fd;
+    (void)capacity;
+    return 0;
+#endif
+}
+
 /**
  * A TwoWayPipe that allows reading and writing between two processes
  * must call initialize before being passed between processes or used
@@ -29,13 +466,48 @@ class TwoWayPipe {
 private:
     //[0] is the output end of each pipe and [1] is the input end of
     // each pipe
-    int input_pipe_file_descriptor[2];
-    int output_pipe_file_descriptor[2];
+    int input_pipe_file_descriptor[2] = {-1, -1};
+    int output_pipe_file_descriptor[2] = {-1, -1};
     std::string internalBuffer;
     bool inStreamGood = true;
     bool endSelected = false;
     bool initialized = false;
+    // whether the child's output end is a pty rather than a pipe
+    bool isPty = false;
+    // the child this pipe is connected to, for tracing
+    pid_t traceChild = 0;
+    bool sawFirstByte = false;
     size_t currentSearchPos = 0;
+
+    /**
+     * opens a pseudo-terminal in place of the pipe carrying the child's output
+     * @return false if any step failed
+     * */
+    bool openPty() {
+        int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (master < 0) return false;
+        char slaveName[64];
+        if (grantpt(master) < 0 || unlockpt(master) < 0 || ptsname_r(master, slaveName, sizeof(slaveName)) != 0) {
+            close(master);
+            return false;
+        }
+        int slave = open(slaveName, O_RDWR | O_NOCTTY);
+        if (slave < 0) {
+            close(master);
+            return false;
+        }
+        // raw mode stops echo and newline translation, so we read back
+        // exactly what the child wrote
+        struct termios attrs;
+        if (tcgetattr(slave, &attrs) == 0) {
+            cfmakeraw(&attrs);
+            tcsetattr(slave, TCSANOW, &attrs);
+        }
+        input_pipe_file_descriptor[0] = master;
+        input_pipe_file_descriptor[1] = slave;
+        return true;
+    }
+
     /**
      * closes the ends that aren't used (do we need to do this?
      * */
@@ -53,18 +525,39 @@ private:
      * error
      * */
     ssize_t readToInternalBuffer() {
-        char buf[256];
+        char buf[READ_CHUNK_SIZE];
         ssize_t bytesCounted = -1;
+        int64_t traceStart = tracing() ? traceNow() : 0;
 
-        while ((bytesCounted = read(input_pipe_file_descriptor[0], buf, 256)) <= 0) {
+        while ((bytesCounted = read(input_pipe_file_descriptor[0], buf, READ_CHUNK_SIZE)) <= 0) {
             if (bytesCounted < 0) {
+                if (isPty && errno == EIO) { /* a pty reports a closed slave as EIO */
+                    bytesCounted = 0;
+                    break;
+                }
                 if (errno != EINTR) { /* interrupted by sig handler return */
                     inStreamGood = false;
                     return -1;
                 }
             } else if (bytesCounted == 0) { /* EOF */
+                break;
+            }
+        }
+
+        if (traceStart != 0) {
+            int64_t traceEnd = traceNow();
+            if (bytesCounted == 0) {
+                traceRecord(TraceEventType::Eof, traceChild, traceEnd);
                 return 0;
             }
+            traceRecord(TraceEventType::Read, traceChild, traceStart, traceEnd - traceStart, bytesCounted);
+            if (!sawFirstByte) {
+                sawFirstByte = true;
+                traceRecord(TraceEventType::FirstByte, traceChild, traceEnd);
+            }
+        }
+        if (bytesCounted == 0) {
+            return 0;
         }
 
         internalBuffer.append(buf, bytesCounted);
@@ -80,7 +573,11 @@ private:
         // file descriptor struct to check if pollin bit will be set
         struct pollfd fds = {.fd = input_pipe_file_descriptor[0], .events = POLLIN};
         // poll with no wait time
+        int64_t traceStart = wait_ms != 0 && tracing() ? traceNow() : 0;
         int res = poll(&fds, 1, wait_ms);
+        if (traceStart != 0) {
+            traceRecord(TraceEventType::Poll, traceChild, traceStart, traceNow() - traceStart);
+        }
 
         // if res < 0 then an error occurred with poll
         // POLLERR is set for some other errors
@@ -100,18 +597,33 @@ public:
     /**
      * initializes the TwoWayPipe the pipe can not be used until
      * this is called
+     * @param stdinCapacity - requested kernel buffer size of the pipe feeding the
+     * child's stdin (0 keeps the kernel default)
+     * @param stdoutCapacity - requested kernel buffer size of the pipe carrying the
+     * child's stdout (0 keeps the kernel default, ignored for a pty)
+     * @param mode - whether the child's output goes through a pipe or a pty
      * */
-    void initialize() {
+    void initialize(size_t stdinCapacity = 0, size_t stdoutCapacity = 0, StdioMode mode = StdioMode::Pipe) {
         if (initialized) {
             return;
         }
-        bool failed = pipe(input_pipe_file_descriptor) < 0;
+        isPty = mode == StdioMode::Pty;
+        bool failed = isPty ? !openPty() : pipe(input_pipe_file_descriptor) < 0;
         failed |= pipe(output_pipe_file_descriptor) < 0;
         if (failed)
         {
+            // don't hold on to whichever half did open
+            for (int fd : {input_pipe_file_descriptor[0], input_pipe_file_descriptor[1],
+                         output_pipe_file_descriptor[0], output_pipe_file_descriptor[1]}) {
+                if (fd >= 0) close(fd);
+            }
+            input_pipe_file_descriptor[0] = input_pipe_file_descriptor[1] = -1;
+            output_pipe_file_descriptor[0] = output_pipe_file_descriptor[1] = -1;
             // error occurred, check errno and throw relevant exception
         } else {
             initialized = true;
+            setPipeCapacity(output_pipe_file_descriptor[1], stdinCapacity);
+            setPipeCapacity(input_pipe_file_descriptor[0], stdoutCapacity);
         }
     }
 
@@ -154,7 +666,68 @@ public:
      * @return the number of bytes written
      * */
     size_t writeP(const std::string& input) {
-        return write(output_pipe_file_descriptor[1], input.c_str(), input.size());
+        int64_t traceStart = tracing() ? traceNow() : 0;
+        ssize_t written = write(output_pipe_file_descriptor[1], input.c_str(), input.size());
+        if (traceStart != 0 && written >= 0) {
+            traceRecord(TraceEventType::Write, traceChild, traceStart, traceNow() - traceStart, written);
+        }
+        return written;
+    }
+
+    /**
+     * writes as much of the buffer as the pipe takes in one go, recording it if
+     * tracing. Never raises SIGPIPE, a child that exited gives EPIPE instead.
+     * @return the number of bytes written, or -1 with errno set
+     * */
+    ssize_t writeSome(const char* buf, size_t len) {
+        int64_t traceStart = tracing() ? traceNow() : 0;
+        ssize_t n = writeWithoutSigpipe(output_pipe_file_descriptor[1], buf, len);
+        if (traceStart != 0 && n >= 0) {
+            traceRecord(TraceEventType::Write, traceChild, traceStart, traceNow() - traceStart, n);
+        }
+        return n;
+    }
+
+    /**
+     * writes all of the input, reading whatever the child outputs meanwhile into
+     * the internal buffer. A child that stops reading stdin because its stdout is
+     * full then can't deadlock against us, however much input there is.
+     * @param input - the string to write
+     * @return the number of bytes written, short if the child stopped reading
+     * */
+    size_t writeDraining(const std::string& input) {
+        int fd = output_pipe_file_descriptor[1];
+        int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        // whether the child's output may still have something for us
+        bool outputOpen = inStreamGood;
+        size_t written = 0;
+        while (written < input.size()) {
+            ssize_t n = writeSome(input.data() + written, input.size() - written);
+            if (n >= 0) {
+                written += n;
+                continue;
+            }
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) break;
+
+            // stdin is full, wait for room while emptying stdout so the child can progress
+            struct pollfd fds[2] = {{fd, POLLOUT, 0}, {outputOpen ? input_pipe_file_descriptor[0] : -1, POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+            if (fds[1].revents != 0 && readToInternalBuffer() <= 0) {
+                // EOF stays for readLine to find, we just stop watching
+                outputOpen = false;
+            }
+        }
+        fcntl(fd, F_SETFL, flags);
+        return written;
+    }
+
+    /**
+     * sets the pid that traced events on this pipe are attributed to
+     * */
+    void setTraceChild(pid_t child) {
+        traceChild = child;
     }
 
     /**
@@ -199,6 +772,37 @@ public:
         return endOfInternalBuffer;
     }
 
+    /**
+     * Calls func(begin, end) with every remaining line until EOF, without its
+     * trailing newline. The pointers point straight into the internal buffer
+     * and are only valid during the call, but no per line allocation happens.
+     * */
+    template <typename Func>
+    void forEachLine(Func func) {
+        size_t lineStart = 0;
+        size_t searchFrom = currentSearchPos;
+        while (true) {
+            size_t newLine;
+            while ((newLine = internalBuffer.find('\n', searchFrom)) != std::string::npos) {
+                func(internalBuffer.data() + lineStart, internalBuffer.data() + newLine);
+                lineStart = searchFrom = newLine + 1;
+            }
+            // drop the consumed lines, the partial one is kept for the next read
+            internalBuffer.erase(0, lineStart);
+            lineStart = 0;
+            searchFrom = internalBuffer.size();
+            if (!inStreamGood || readToInternalBuffer() <= 0) {
+                inStreamGood = false;
+                break;
+            }
+        }
+        if (!internalBuffer.empty()) {
+            func(internalBuffer.data(), internalBuffer.data() + internalBuffer.size());
+            internalBuffer.clear();
+        }
+        currentSearchPos = 0;
+    }
+
     bool canReadLine(long wait_ms) {
         if (!inStreamGood) {
             return false;
@@ -217,6 +821,9 @@ public:
                 if (pipeState & POLLHUP) {             // the write end has closed
                     if (internalBuffer.size() == 0) {  // and theres no bytes in the buffer
                                                        // this pipe is done
+                        if (inStreamGood && tracing()) {
+                            traceRecord(TraceEventType::Eof, traceChild, traceNow());
+                        }
                         inStreamGood = false;
                         return false;
                     }
@@ -237,112 +844,855 @@ public:
     }
 
     void closeOutput() {
-        close(output_pipe_file_descriptor[1]);
+        if (output_pipe_file_descriptor[1] >= 0) {
+            close(output_pipe_file_descriptor[1]);
+            output_pipe_file_descriptor[1] = -1;
+        }
     }
-};
-
-/**
- * A Process class that wraps the creation of a seperate process
- * and gives acces to a TwoWayPipe to that process and its pid
- * The Process is not in a valid state until start is called
- * This class does not have ownership of the process, it merely maintains a
- * connection
- * */
-class Process {
-    pid_t pid;
-    TwoWayPipe pipe;
-
-public:
-    Process() = default;
 
     /**
-     * Starts a seperate process with the provided command and
-     * arguments This also initializes the TwoWayPipe
-     * @param commandPath - an absolute string to the program path
-     * @param argsItBegin - the begin iterator to strings that
-     * will be passed as arguments
-     * @param argsItEnd - the end iterator to strings that
-     * will be passed as arguments
-     * @return TODO return errno returned by child call of execv
-     * (need to use the TwoWayPipe)
+     * closes the end we read the child's output from, once nothing more is wanted from it
      * */
-    template <class InputIT>
-    void start(const std::string& commandPath, InputIT argsItBegin, InputIT argsItEnd) {
-        pid = 0;
-        pipe.initialize();
-        // construct the argument list (unfortunately,
-        // the C api wasn't defined with C++ in mind, so
-        // we have to abuse const_cast) see:
-        // https://stackoverflow.com/a/190208
-        std::vector<char*> cargs;
-        // the process name must be first for execv
-        cargs.push_back(const_cast<char*>(commandPath.c_str()));
-        while (argsItBegin != argsItEnd) {
-            cargs.push_back(const_cast<char*>((*argsItBegin).c_str()));
-            argsItBegin++;
-        }
-        // must be terminated with a nullptr for execv
-        cargs.push_back(nullptr);
-
-        pid = fork();
-        // child
-        if (pid == 0) {
-            pipe.setAsChildEnd();
-
-            // ask kernel to deliver SIGTERM
-            // in case the parent dies
-            prctl(PR_SET_PDEATHSIG, SIGTERM);
-
-            execv(commandPath.c_str(), cargs.data());
-            // Nothing below this line
-            // should be executed by child
-            // process. If so, it means that
-            // the execl function wasn't
-            // successfull, so lets exit:
-            exit(1);
+    void closeInput() {
+        if (input_pipe_file_descriptor[0] >= 0) {
+            close(input_pipe_file_descriptor[0]);
+            input_pipe_file_descriptor[0] = -1;
         }
-        pipe.setAsParentEnd();
+        inStreamGood = false;
     }
 
-    template <typename Rep = long>
-    bool isReady(std::chrono::duration<Rep> timeout = std::chrono::duration<long>(0)) {
-        if (timeout.count() < 0) {
-            return pipe.canReadLine(-1);
-        }
-        return pipe.canReadLine(std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count());
+    /**
+     * @return the descriptor this end reads from, for use with poll and friends
+     * */
+    int readFileDescriptor() const {
+        return input_pipe_file_descriptor[0];
     }
 
-    template <typename Rep = long>
-    std::string readLine(std::chrono::duration<Rep> timeout = std::chrono::duration<long>(-1)) {
-        if (isReady(timeout)) {
-            return pipe.readLine();
-        }
-        return "";
+    /**
+     * @return the descriptor this end writes to, for use with poll and friends
+     * */
+    int writeFileDescriptor() const {
+        return output_pipe_file_descriptor[1];
     }
+};
 
-    size_t write(const std::string& input) {
-        return pipe.writeP(input);
+/**
+ * A single-producer single-consumer byte ring living in a memfd, for moving
+ * large amounts of data between a parent and a cooperating child without
+ * copying it through the kernel. Wakeups are delivered through two eventfds,
+ * which are only signalled when the other side is actually waiting.
+ * The parent creates the ring and hands it to a child with
+ * Process::shareRing, the child then picks it up with fromEnvironment.
+ * Each ring is one-directional, use two of them for a duplex channel.
+ * Both sides watch the other process, so like a pipe a blocked read or
+ * write returns once the peer has gone away.
+ * */
+class SharedRing {
+private:
+    struct Header {
+        // total bytes ever written and read, the difference is the fill level
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) std::atomic<uint32_t> readerWaiting;
+        std::atomic<uint32_t> writerWaiting;
+        std::atomic<uint32_t> closed;
+        std::atomic<uint32_t> readerClosed;
+        uint64_t capacity;
+    };
+
+    int memfd = -1;
+    // signalled when data is available / when space is available
+    int dataEvent = -1;
+    int spaceEvent = -1;
+    Header* header = nullptr;
+    char* data = nullptr;
+    size_t mappedSize = 0;
+    // the process on the other end, watched through a pidfd where possible
+    pid_t peerPid = 0;
+    int peerFd = -1;
+    bool peerDead = false;
+
+    static size_t headerSize() {
+        size_t page = sysconf(_SC_PAGESIZE);
+        return (sizeof(Header) + page - 1) / page * page;
     }
 
-    void sendEOF() {
-        pipe.closeOutput();
+    bool map(size_t totalSize) {
+        void* mem = mmap(nullptr, totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (mem == MAP_FAILED) return false;
+        mappedSize = totalSize;
+        header = static_cast<Header*>(mem);
+        data = static_cast<char*>(mem) + headerSize();
+        return true;
     }
 
-    bool isGood() const {
-        return pipe.isGood();
+    static void signal(int eventFd) {
+        uint64_t one = 1;
+        while (::write(eventFd, &one, sizeof(one)) < 0 && errno == EINTR) {
+        }
     }
 
     /**
-     * blocks until the process exits and returns the exit
-     * closeUnusedEnds
+     * @return false if the process is gone or is a zombie waiting to be reaped
      * */
-    int waitUntilFinished() {
-        int status;
-        waitpid(pid, &status, 0);
-        return status;
+    static bool processAlive(pid_t pid) {
+        if (kill(pid, 0) < 0 && errno == ESRCH) return false;
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+        FILE* stat = fopen(path, "re");
+        if (stat == nullptr) return true;
+        char state = 0;
+        // the state follows the parenthesised command name
+        int matched = fscanf(stat, "%*d (%*[^)]) %c", &state);
+        fclose(stat);
+        return matched != 1 || state != 'Z';
     }
-};
+
+    /**
+     * blocks until the eventfd is signalled or the peer process exits
+     * @return false once the peer has exited
+     * */
+    bool waitOn(int eventFd) {
+        if (peerDead) return false;
+        // poll ignores the negative descriptor when there is no pidfd, in
+        // which case the peer is checked periodically instead
+        struct pollfd fds[2] = {{eventFd, POLLIN, 0}, {peerFd, POLLIN, 0}};
+        int timeout = peerFd < 0 && peerPid > 0 ? 100 : -1;
+        while (true) {
+            int res = poll(fds, 2, timeout);
+            if (res < 0 && errno != EINTR) {
+                peerDead = true;
+                return false;
+            }
+            if (fds[0].revents & POLLIN) {
+                uint64_t count;
+                ssize_t ignored = ::read(eventFd, &count, sizeof(count));
+                (void)ignored;
+                return true;
+            }
+            if (fds[1].revents != 0 || (res == 0 && !processAlive(peerPid))) {
+                peerDead = true;
+                return false;
+            }
+        }
+    }
+
+    void release() {
+        if (header != nullptr) munmap(header, mappedSize);
+        if (memfd >= 0) close(memfd);
+        if (dataEvent >= 0) close(dataEvent);
+        if (spaceEvent >= 0) close(spaceEvent);
+        if (peerFd >= 0) close(peerFd);
+        header = nullptr;
+        data = nullptr;
+        memfd = dataEvent = spaceEvent = peerFd = -1;
+        peerPid = 0;
+        peerDead = false;
+    }
+
+public:
+    SharedRing() = default;
+    SharedRing(const SharedRing&) = delete;
+    SharedRing& operator=(const SharedRing&) = delete;
+
+    SharedRing(SharedRing&& other) {
+        *this = std::move(other);
+    }
+
+    SharedRing& operator=(SharedRing&& other) {
+        if (this != &other) {
+            release();
+            std::swap(memfd, other.memfd);
+            std::swap(dataEvent, other.dataEvent);
+            std::swap(spaceEvent, other.spaceEvent);
+            std::swap(header, other.header);
+            std::swap(data, other.data);
+            std::swap(mappedSize, other.mappedSize);
+            std::swap(peerPid, other.peerPid);
+            std::swap(peerFd, other.peerFd);
+            std::swap(peerDead, other.peerDead);
+        }
+        return *this;
+    }
+
+    ~SharedRing() {
+        release();
+    }
+
+    /**
+     * creates a new ring, the descriptors are close-on-exec so they are only
+     * inherited by children the ring is explicitly shared with
+     * @param capacity - the size of the data area, rounded up to a power of two
+     * @return the ring, check isValid for failure
+     * */
+    static SharedRing create(size_t capacity) {
+        SharedRing ring;
+        size_t roundedCapacity = 4096;
+        while (roundedCapacity < capacity) roundedCapacity <<= 1;
+
+        ring.memfd = memfd_create("subprocess-ring", MFD_CLOEXEC);
+        ring.dataEvent = eventfd(0, EFD_CLOEXEC);
+        ring.spaceEvent = eventfd(0, EFD_CLOEXEC);
+        if (ring.memfd < 0 || ring.dataEvent < 0 || ring.spaceEvent < 0 ||
+                ftruncate(ring.memfd, headerSize() + roundedCapacity) < 0 ||
+                !ring.map(headerSize() + roundedCapacity)) {
+            ring.release();
+            return ring;
+        }
+        // the memfd is zero filled, so the counters already start at 0
+        ring.header->capacity = roundedCapacity;
+        return ring;
+    }
+
+    /**
+     * attaches to a ring that was shared with this process by its parent
+     * @param envName - the name the parent passed to Process::shareRing
+     * @return the ring, check isValid for failure
+     * */
+    static SharedRing fromEnvironment(const std::string& envName) {
+        SharedRing ring;
+        const char* desc = getenv(envName.c_str());
+        int parent = 0;
+        if (desc == nullptr ||
+                sscanf(desc, "%d:%d:%d:%d", &ring.memfd, &ring.dataEvent, &ring.spaceEvent, &parent) != 4) {
+            ring.memfd = ring.dataEvent = ring.spaceEvent = -1;
+            return ring;
+        }
+        // don't leak the ring into our own children
+        fcntl(ring.memfd, F_SETFD, FD_CLOEXEC);
+        fcntl(ring.dataEvent, F_SETFD, FD_CLOEXEC);
+        fcntl(ring.spaceEvent, F_SETFD, FD_CLOEXEC);
+        struct stat st;
+        if (fstat(ring.memfd, &st) < 0 || !ring.map(st.st_size)) {
+            ring.release();
+            return ring;
+        }
+        ring.setPeer(parent);
+        // if we were reparented, the parent died before we could watch it
+        if (getppid() != parent) ring.peerDead = true;
+        return ring;
+    }
+
+    /**
+     * sets the process on the other end of the ring, whose exit unblocks
+     * reads and writes. Process::start and fromEnvironment call this.
+     * */
+    void setPeer(pid_t pid) {
+        if (peerFd >= 0) close(peerFd);
+        peerPid = pid;
+        peerFd = -1;
+        peerDead = false;
+#ifdef SYS_pidfd_open
+        peerFd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    }
+
+    /**
+     * @return true once a blocked read or write noticed the peer had exited
+     * */
+    bool peerExited() const {
+        return peerDead;
+    }
+
+    bool isValid() const {
+        return header != nullptr;
+    }
+
+    /**
+     * @return the string a child needs to attach to this ring, of the
+     * form "memfd:dataEvent:spaceEvent:parentPid"
+     * */
+    std::string descriptor() const {
+        return std::to_string(memfd) + ":" + std::to_string(dataEvent) + ":" + std::to_string(spaceEvent) + ":" +
+               std::to_string(getpid());
+    }
+
+    /**
+     * @return the file descriptors that must survive exec in the child
+     * */
+    std::vector<int> fileDescriptors() const {
+        return {memfd, dataEvent, spaceEvent};
+    }
+
+    /**
+     * writes all of the bytes into the ring, blocking while it is full
+     * @return the number of bytes written, which is short if the reader
+     * closed the ring or exited
+     * */
+    size_t write(const char* buf, size_t len) {
+        const uint64_t capacity = header->capacity;
+        size_t written = 0;
+        while (written < len) {
+            if (header->readerClosed.load()) break;
+            uint64_t head = header->head.load(std::memory_order_relaxed);
+            uint64_t tail = header->tail.load(std::memory_order_acquire);
+            if (head - tail == capacity) {
+                // announce we are waiting, then recheck so a concurrent read isn't missed
+                header->writerWaiting.store(1);
+                bool peerAlive = true;
+                if (header->head.load() - header->tail.load() == capacity && !header->readerClosed.load()) {
+                    peerAlive = waitOn(spaceEvent);
+                }
+                header->writerWaiting.store(0);
+                if (!peerAlive) break;
+                continue;
+            }
+            size_t chunk = std::min<uint64_t>(len - written, capacity - (head - tail));
+            size_t offset = head & (capacity - 1);
+            size_t firstPart = std::min<size_t>(chunk, capacity - offset);
+            memcpy(data + offset, buf + written, firstPart);
+            memcpy(data, buf + written + firstPart, chunk - firstPart);
+            header->head.store(head + chunk);
+            written += chunk;
+            if (header->readerWaiting.load()) signal(dataEvent);
+        }
+        return written;
+    }
+
+    size_t write(const std::string& input) {
+        return write(input.data(), input.size());
+    }
+
+    /**
+     * reads whatever is available in the ring, blocking while it is empty
+     * @return the number of bytes read, 0 once the writer has closed the ring
+     * or exited, and the ring has been drained
+     * */
+    size_t read(char* buf, size_t len) {
+        const uint64_t capacity = header->capacity;
+        while (true) {
+            uint64_t tail = header->tail.load(std::memory_order_relaxed);
+            uint64_t head = header->head.load(std::memory_order_acquire);
+            if (head == tail) {
+                // anything a dead writer wrote is already visible, so this is EOF
+                if (header->closed.load() || peerDead) return 0;
+                header->readerWaiting.store(1);
+                if (header->head.load() == header->tail.load() && !header->closed.load()) {
+                    waitOn(dataEvent);
+                }
+                header->readerWaiting.store(0);
+                continue;
+            }
+            size_t chunk = std::min<uint64_t>(len, head - tail);
+            size_t offset = tail & (capacity - 1);
+            size_t firstPart = std::min<size_t>(chunk, capacity - offset);
+            memcpy(buf, data + offset, firstPart);
+            memcpy(buf + firstPart, data, chunk - firstPart);
+            header->tail.store(tail + chunk);
+            if (header->writerWaiting.load()) signal(spaceEvent);
+            return chunk;
+        }
+    }
+
+    /**
+     * marks the ring as finished, the reader sees EOF once it drains it
+     * */
+    void closeWriter() {
+        header->closed.store(1);
+        signal(dataEvent);
+    }
+
+    /**
+     * tells the writer nothing more will be read, its writes return short
+     * */
+    void closeReader() {
+        header->readerClosed.store(1);
+        signal(spaceEvent);
+    }
+};
+
+/**
+ * A Process class that wraps the creation of a seperate process
+ * and gives acces to a TwoWayPipe to that process and its pid
+ * The Process is not in a valid state until start is called
+ * This class does not have ownership of the process, it merely maintains a
+ * connection
+ * */
+class Process {
+    pid_t pid;
+    TwoWayPipe pipe;
+    size_t stdinCapacity = 0;
+    size_t stdoutCapacity = 0;
+    StdioMode stdioMode = StdioMode::Pipe;
+    // environment entries and descriptors of rings handed to the child
+    std::vector<std::string> ringEnvironment;
+    std::vector<int> ringFileDescriptors;
+    std::vector<SharedRing*> sharedRings;
+
+public:
+    Process() = default;
+
+    /**
+     * requests larger kernel pipe buffers, so that fewer context switches are
+     * needed when streaming a lot of data. Must be called before start.
+     * @param stdinBytes - capacity of the pipe into the child (0 for the default)
+     * @param stdoutBytes - capacity of the pipe out of the child (0 for the default)
+     * */
+    void setPipeCapacity(size_t stdinBytes, size_t stdoutBytes) {
+        stdinCapacity = stdinBytes;
+        stdoutCapacity = stdoutBytes;
+    }
+
+    /**
+     * selects how the child's stdout and stderr are connected, StdioMode::Pty
+     * makes most programs flush every line instead of every few KiB, which
+     * matters for request/response style interaction. Must be called before start.
+     * */
+    void setStdioMode(StdioMode mode) {
+        stdioMode = mode;
+    }
+
+    /**
+     * hands a SharedRing to the child, which can attach to it with
+     * SharedRing::fromEnvironment(envName). Must be called before start, and
+     * the ring must live until start returns, which makes the child its peer.
+     * */
+    void shareRing(const std::string& envName, SharedRing& ring) {
+        sharedRings.push_back(&ring);
+        ringEnvironment.push_back(envName + "=" + ring.descriptor());
+        std::vector<int> fds = ring.fileDescriptors();
+        ringFileDescriptors.insert(ringFileDescriptors.end(), fds.begin(), fds.end());
+    }
+
+    /**
+     * Starts a seperate process with the provided command and
+     * arguments This also initializes the TwoWayPipe
+     * @param commandPath - an absolute string to the program path
+     * @param argsItBegin - the begin iterator to strings that
+     * will be passed as arguments
+     * @param argsItEnd - the end iterator to strings that
+     * will be passed as arguments
+     * @return TODO return errno returned by child call of execv
+     * (need to use the TwoWayPipe)
+     * */
+    template <class InputIT>
+    void start(const std::string& commandPath, InputIT argsItBegin, InputIT argsItEnd) {
+        pid = 0;
+        pipe.initialize(stdinCapacity, stdoutCapacity, stdioMode);
+        // construct the argument list (unfortunately,
+        // the C api wasn't defined with C++ in mind, so
+        // we have to abuse const_cast) see:
+        // https://stackoverflow.com/a/190208
+        std::vector<char*> cargs;
+        // the process name must be first for execv
+        cargs.push_back(const_cast<char*>(commandPath.c_str()));
+        while (argsItBegin != argsItEnd) {
+            cargs.push_back(const_cast<char*>((*argsItBegin).c_str()));
+            argsItBegin++;
+        }
+        // must be terminated with a nullptr for execv
+        cargs.push_back(nullptr);
+
+        // if rings are shared, the environment has to be built before forking,
+        // as allocating in the child isn't safe
+        std::vector<char*> cenv;
+        if (!ringEnvironment.empty()) {
+            for (char** var = environ; *var != nullptr; ++var) {
+                // getenv finds the first match, so an inherited variable of
+                // the same name would hide the ring
+                bool replaced = false;
+                for (const std::string& ringVar : ringEnvironment) {
+                    size_t nameLength = ringVar.find('=') + 1;
+                    replaced |= strncmp(*var, ringVar.c_str(), nameLength) == 0;
+                }
+                if (!replaced) cenv.push_back(*var);
+            }
+            for (std::string& var : ringEnvironment) {
+                cenv.push_back(const_cast<char*>(var.c_str()));
+            }
+            cenv.push_back(nullptr);
+        }
+
+        // when tracing, the child reports a failed exec through a close-on-exec
+        // pipe, so reading EOF from it means the exec succeeded
+        int execStatusPipe[2] = {-1, -1};
+        int64_t traceStart = 0;
+        if (tracing()) {
+            traceStart = traceNow();
+            if (::pipe2(execStatusPipe, O_CLOEXEC) < 0) {
+                execStatusPipe[0] = execStatusPipe[1] = -1;
+            }
+        }
+
+        pid = fork();
+        // child
+        if (pid == 0) {
+            pipe.setAsChildEnd();
+
+            // ask kernel to deliver SIGTERM
+            // in case the parent dies
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+            if (!cenv.empty()) {
+                // rings are close-on-exec, so only this child inherits them
+                for (int fd : ringFileDescriptors) {
+                    fcntl(fd, F_SETFD, 0);
+                }
+                execve(commandPath.c_str(), cargs.data(), cenv.data());
+            } else {
+                execv(commandPath.c_str(), cargs.data());
+            }
+            // Nothing below this line
+            // should be executed by child
+            // process. If so, it means that
+            // the execl function wasn't
+            // successfull, so lets exit:
+            if (execStatusPipe[1] >= 0) {
+                int execErrno = errno;
+                ssize_t ignored = ::write(execStatusPipe[1], &execErrno, sizeof(execErrno));
+                (void)ignored;
+            }
+            exit(1);
+        }
+        pipe.setTraceChild(pid);
+        pipe.setAsParentEnd();
+        for (SharedRing* ring : sharedRings) {
+            ring->setPeer(pid);
+        }
+        sharedRings.clear();
+        if (traceStart != 0) {
+            int64_t forked = traceNow();
+            traceRecord(TraceEventType::Spawn, pid, traceStart, forked - traceStart);
+            if (execStatusPipe[0] >= 0) {
+                close(execStatusPipe[1]);
+                int execErrno = 0;
+                ssize_t n;
+                while ((n = read(execStatusPipe[0], &execErrno, sizeof(execErrno))) < 0 && errno == EINTR) {
+                }
+                close(execStatusPipe[0]);
+                bool failed = n == static_cast<ssize_t>(sizeof(execErrno));
+                traceRecord(failed ? TraceEventType::ExecFailed : TraceEventType::Exec, pid, forked,
+                        traceNow() - forked, failed ? execErrno : 0);
+            }
+        }
+    }
+
+    template <typename Rep = long>
+    bool isReady(std::chrono::duration<Rep> timeout = std::chrono::duration<long>(0)) {
+        if (timeout.count() < 0) {
+            return pipe.canReadLine(-1);
+        }
+        return pipe.canReadLine(std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count());
+    }
+
+    template <typename Rep = long>
+    std::string readLine(std::chrono::duration<Rep> timeout = std::chrono::duration<long>(-1)) {
+        if (isReady(timeout)) {
+            return pipe.readLine();
+        }
+        return "";
+    }
+
+    size_t write(const std::string& input) {
+        return pipe.writeP(input);
+    }
+
+    /**
+     * see TwoWayPipe::writeDraining
+     * */
+    size_t writeDraining(const std::string& input) {
+        return pipe.writeDraining(input);
+    }
+
+    /**
+     * see TwoWayPipe::writeSome
+     * */
+    ssize_t writeSome(const char* buf, size_t len) {
+        return pipe.writeSome(buf, len);
+    }
+
+    void sendEOF() {
+        pipe.closeOutput();
+    }
+
+    /**
+     * see TwoWayPipe::closeInput
+     * */
+    void closeInput() {
+        pipe.closeInput();
+    }
+
+    bool isGood() const {
+        return pipe.isGood();
+    }
+
+    /**
+     * see TwoWayPipe::forEachLine
+     * */
+    template <typename Func>
+    void forEachLine(Func func) {
+        pipe.forEachLine(func);
+    }
+
+    /**
+     * blocks until the process exits and returns the exit
+     * closeUnusedEnds
+     * */
+    int waitUntilFinished() {
+        int status;
+        int64_t traceStart = tracing() ? traceNow() : 0;
+        waitpid(pid, &status, 0);
+        if (traceStart != 0) {
+            int64_t reaped = traceNow();
+            traceRecord(TraceEventType::Wait, pid, traceStart, reaped - traceStart);
+            traceRecord(TraceEventType::Exit, pid, reaped, 0, status);
+        }
+        return status;
+    }
+
+    /**
+     * reaps the process if it has already exited, without blocking
+     * @param status - set to the exit status if the process was reaped
+     * @return true if the process was reaped
+     * */
+    bool tryWait(int& status) {
+        if (waitpid(pid, &status, WNOHANG) != pid) {
+            return false;
+        }
+        if (tracing()) {
+            traceRecord(TraceEventType::Exit, pid, traceNow(), 0, status);
+        }
+        return true;
+    }
+
+    pid_t getPid() const {
+        return pid;
+    }
+
+    const TwoWayPipe& getPipe() const {
+        return pipe;
+    }
+};
+}
+
+/**
+ * A non-owning view of characters, used for record fields that should be
+ * handed out without copying them. Only valid during the callback it is passed to.
+ * */
+struct StringRef {
+    const char* data;
+    size_t size;
+
+    std::string str() const {
+        return std::string(data, size);
+    }
+
+    bool operator==(const std::string& other) const {
+        return other.size() == size && std::equal(data, data + size, other.begin());
+    }
+
+    bool operator!=(const std::string& other) const {
+        return !((*this) == other);
+    }
+};
+
+namespace internal {
+template <size_t... I>
+struct IndexSequence {};
+
+template <size_t N, size_t... I>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> {};
+
+template <size_t... I>
+struct MakeIndexSequence<0, I...> : IndexSequence<I...> {};
+
+/**
+ * parses a whole field into an integer, the field must contain nothing but
+ * an optional minus sign and digits
+ * @return false if the field isn't a number or doesn't fit in T
+ * */
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, bool>::type parseField(
+        const char* begin, const char* end, T& out) {
+#if SUBPROCESSCPP_HAS_FROM_CHARS
+    std::from_chars_result res = std::from_chars(begin, end, out);
+    return res.ec == std::errc() && res.ptr == end;
+#else
+    typedef typename std::make_unsigned<T>::type Unsigned;
+    bool negative = std::is_signed<T>::value && begin != end && *begin == '-';
+    if (negative) ++begin;
+    if (begin == end) return false;
+
+    Unsigned limit = static_cast<Unsigned>(std::numeric_limits<T>::max()) + (negative ? 1 : 0);
+    Unsigned value = 0;
+    for (; begin != end; ++begin) {
+        unsigned digit = static_cast<unsigned char>(*begin) - '0';
+        if (digit > 9 || value > (limit - digit) / 10) return false;
+        value = value * 10 + digit;
+    }
+    out = static_cast<T>(negative ? 0 - value : value);
+    return true;
+#endif
 }
+
+/**
+ * checks a field is a plain decimal number: [-]digits[.digits][e[+-]digits],
+ * where either side of the point may be empty but not both. Hex, inf, nan and
+ * a leading + or whitespace are rejected, whichever standard library is used.
+ * */
+inline bool isPlainDecimal(const char* begin, const char* end) {
+    if (begin != end && *begin == '-') ++begin;
+    const char* digitsStart = begin;
+    while (begin != end && isdigit(static_cast<unsigned char>(*begin))) ++begin;
+    size_t digits = begin - digitsStart;
+    if (begin != end && *begin == '.') {
+        const char* fractionStart = ++begin;
+        while (begin != end && isdigit(static_cast<unsigned char>(*begin))) ++begin;
+        digits += begin - fractionStart;
+    }
+    if (digits == 0) return false;
+    if (begin != end && (*begin == 'e' || *begin == 'E')) {
+        ++begin;
+        if (begin != end && (*begin == '+' || *begin == '-')) ++begin;
+        const char* exponentStart = begin;
+        while (begin != end && isdigit(static_cast<unsigned char>(*begin))) ++begin;
+        if (begin == exponentStart) return false;
+    }
+    return begin == end;
+}
+
+#if !(SUBPROCESSCPP_HAS_FROM_CHARS && defined(__cpp_lib_to_chars))
+/**
+ * the C locale, so that parsing doesn't depend on the caller's LC_NUMERIC
+ * */
+inline locale_t cLocale() {
+    static locale_t locale = newlocale(LC_ALL_MASK, "C", static_cast<locale_t>(0));
+    return locale;
+}
+
+inline void strtoFloat(const char* str, char** end, float& out) {
+    out = strtof_l(str, end, cLocale());
+}
+
+inline void strtoFloat(const char* str, char** end, double& out) {
+    out = strtod_l(str, end, cLocale());
+}
+
+inline void strtoFloat(const char* str, char** end, long double& out) {
+    out = strtold_l(str, end, cLocale());
+}
+#endif
+
+/**
+ * parses a whole field into a floating point number
+ * @return false if the field isn't a plain decimal number or doesn't fit in T
+ * */
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, bool>::type parseField(
+        const char* begin, const char* end, T& out) {
+    if (!isPlainDecimal(begin, end)) return false;
+#if SUBPROCESSCPP_HAS_FROM_CHARS && defined(__cpp_lib_to_chars)
+    std::from_chars_result res = std::from_chars(begin, end, out);
+    return res.ec == std::errc() && res.ptr == end;
+#else
+    // strtod needs a terminated string
+    char buf[64];
+    size_t len = end - begin;
+    if (len >= sizeof(buf)) return false;
+    memcpy(buf, begin, len);
+    buf[len] = '\0';
+    char* parsedEnd;
+    errno = 0;
+    T value;
+    strtoFloat(buf, &parsedEnd, value);
+    if (parsedEnd != buf + len || errno == ERANGE) return false;
+    out = value;
+    return true;
+#endif
+}
+
+inline bool parseField(const char* begin, const char* end, StringRef& out) {
+    out.data = begin;
+    out.size = end - begin;
+    return true;
+}
+
+/**
+ * copies the field, this allocates - prefer StringRef where the field
+ * doesn't need to outlive the callback
+ * */
+inline bool parseField(const char* begin, const char* end, std::string& out) {
+    out.assign(begin, end);
+    return true;
+}
+
+/**
+ * parses the field at the cursor and moves the cursor past its delimiter.
+ * The last field runs to the end of the line. A space delimiter matches any
+ * run of spaces, to fit the column aligned output of tools like ps.
+ * */
+template <char Delimiter, typename T>
+bool parseNextField(const char*& cursor, const char* end, T& out, bool isLast) {
+    if (Delimiter == ' ') {
+        while (cursor != end && *cursor == ' ') ++cursor;
+    }
+    const char* fieldEnd = isLast ? end : std::find(cursor, end, Delimiter);
+    if (fieldEnd == end && !isLast) return false;  // not enough fields
+    if (Delimiter == ' ' && isLast) {
+        while (fieldEnd != cursor && fieldEnd[-1] == ' ') --fieldEnd;
+    }
+    bool parsed = parseField(cursor, fieldEnd, out);
+    cursor = isLast ? end : fieldEnd + 1;
+    return parsed;
+}
+
+template <char Delimiter, typename Tuple, size_t... I>
+bool parseFields(const char* begin, const char* end, Tuple& out, IndexSequence<I...>) {
+    bool parsed = true;
+    // braced initializers are evaluated in order, so the fields are parsed left to right
+    bool results[] = {(parsed = parsed &&
+                               parseNextField<Delimiter>(begin, end, std::get<I>(out),
+                                       I + 1 == std::tuple_size<Tuple>::value))...};
+    (void)results;
+    return parsed;
+}
+
+template <typename Struct, typename Tuple, size_t... I>
+Struct makeStruct(const Tuple& fields, IndexSequence<I...>) {
+    return Struct{std::get<I>(fields)...};
+}
+}
+
+/**
+ * Describes the shape of a line of output: its fields, in order, separated
+ * by the delimiter. Fields can be any integral or floating point type,
+ * StringRef, or std::string. Records are delivered as a std::tuple.
+ * e.g. Record<'\t', long, StringRef> for the output of du
+ * */
+template <char Delimiter, typename... Fields>
+struct Record {
+    static_assert(sizeof...(Fields) > 0, "a record needs at least one field");
+    typedef std::tuple<Fields...> tuple_type;
+    typedef tuple_type value_type;
+
+    /**
+     * parses a line (without its newline) into the fields
+     * @return false if the line doesn't match the shape of the record
+     * */
+    static bool parse(const char* begin, const char* end, tuple_type& out) {
+        if (begin != end && end[-1] == '\r') --end;
+        return internal::parseFields<Delimiter>(
+                begin, end, out, internal::MakeIndexSequence<sizeof...(Fields)>());
+    }
+
+    static const value_type& convert(const tuple_type& fields) {
+        return fields;
+    }
+};
+
+/**
+ * A Record that is delivered as an aggregate Struct, which is brace
+ * initialised from the fields in order.
+ * */
+template <typename Struct, char Delimiter, typename... Fields>
+struct StructRecord : Record<Delimiter, Fields...> {
+    typedef Struct value_type;
+
+    static Struct convert(const std::tuple<Fields...>& fields) {
+        return internal::makeStruct<Struct>(fields, internal::MakeIndexSequence<sizeof...(Fields)>());
+    }
+};
+
 /**
  * Execute a subprocess and optionally call a function per line of stdout.
  * @param commandPath   - the path of the executable to execute, e.g. "/bin/cat"
@@ -412,6 +1762,28 @@ std::vector<std::string> check_output(const std::string& commandPath,
 //         ProcessStream& operator>>(std::string& outputLine);
 // };
 
+namespace internal {
+/**
+ * starts the process then feeds it all of the input followed by an EOF. Output
+ * produced meanwhile is buffered, so the child can't block on a full stdout while
+ * we block on its stdin.
+ * @param stringInput - the input to feed, which is consumed
+ * */
+inline void startWithInput(Process& childProcess, const std::string& commandPath,
+        const std::vector<std::string>& commandArgs, std::list<std::string>& stringInput) {
+    childProcess.start(commandPath, commandArgs.begin(), commandArgs.end());
+
+    // while our string queue is working,
+    while (!stringInput.empty()) {
+        // write our input to the process's stdin pipe
+        childProcess.writeDraining(stringInput.front());
+        stringInput.pop_front();
+    }
+
+    childProcess.sendEOF();
+}
+}
+
 /**
  * Execute a process, inputting stdin and calling the functor with the stdout
  * lines.
@@ -426,17 +1798,7 @@ int execute(const std::string& commandPath, const std::vector<std::string>& comm
         std::list<std::string>& stringInput /* what pumps into stdin */,
         std::function<void(std::string)> lambda) {
     internal::Process childProcess;
-    childProcess.start(commandPath, commandArgs.begin(), commandArgs.end());
-
-    // while our string queue is working,
-    while (!stringInput.empty()) {
-        // write our input to the process's stdin pipe
-        std::string newInput = stringInput.front();
-        stringInput.pop_front();
-        childProcess.write(newInput);
-    }
-
-    childProcess.sendEOF();
+    internal::startWithInput(childProcess, commandPath, commandArgs, stringInput);
 
     // iterate over each line output by the child's stdout, and call
     // the functor
@@ -458,6 +1820,40 @@ std::vector<std::string> checkOutput(const std::string& commandPath,
     return retVec;
 }
 
+/**
+ * Execute a process, inputting stdin and calling the functor with every line
+ * of stdout parsed as a RecordType (see Record and StructRecord). Fields are
+ * parsed straight out of the read buffer, so no per line allocation happens.
+ * @param commandPath - an absolute string to the program path
+ * @param commandArgs - a vector of arguments that will be passed to the process
+ * @param stringInput - a feed of strings that feed into the process
+ * @param lambda - the function to execute with every record output by the process
+ * @param malformedLines - if given, set to the number of lines that didn't match
+ * the record and were skipped
+ * @return the exit status of the process
+ * */
+template <typename RecordType>
+int executeRecords(const std::string& commandPath, const std::vector<std::string>& commandArgs,
+        std::list<std::string>& stringInput, std::function<void(const typename RecordType::value_type&)> lambda,
+        size_t* malformedLines = nullptr) {
+    internal::Process childProcess;
+    internal::startWithInput(childProcess, commandPath, commandArgs, stringInput);
+
+    size_t malformed = 0;
+    // reused for every line, so string fields keep their capacity
+    typename RecordType::tuple_type fields;
+    childProcess.forEachLine([&](const char* begin, const char* end) {
+        if (RecordType::parse(begin, end, fields)) {
+            lambda(RecordType::convert(fields));
+        } else {
+            malformed++;
+        }
+    });
+    if (malformedLines != nullptr) *malformedLines = malformed;
+
+    return childProcess.waitUntilFinished();
+}
+
 /* spawn the process in the background asynchronously, and return a future of the status code */
 std::future<int> async(const std::string commandPath, const std::vector<std::string> commandArgs,
         std::list<std::string> stringInput, std::function<void(std::string)> lambda) {
@@ -470,8 +1866,7 @@ std::future<int> async(const std::string commandPath, const std::vector<std::str
             commandPath, commandArgs, stringInput, lambda);
 }
 
-/* TODO: refactor up this function so that there isn't duplicated code - most of this is identical to the
- * execute fn execute a program and stream the output after each line input this function calls select to
+/* execute a program and stream the output after each line input this function calls select to
  * check if outputs needs to be pumped after each line input. This means that if the line takes too long to
  * output, it may be not input into the functor until another line is fed in. You may modify the delay to try
  * and wait longer until moving on. This delay must exist, as several programs may not output a line for each
@@ -481,20 +1876,9 @@ class ProcessStream {
 
 public:
     ProcessStream(const std::string& commandPath, const std::vector<std::string>& commandArgs,
-            std::list<std::string>& stringInput) {
-        childProcess.start(commandPath, commandArgs.begin(), commandArgs.end());
-
-        // while our string queue is working,
-        while (!stringInput.empty()) {
-            // write our input to the
-            // process's stdin pipe
-            std::string newInput = stringInput.front();
-            stringInput.pop_front();
-            childProcess.write(newInput);
-        }
-        // now we finished chucking in the string, send
-        // an EOF
-        childProcess.sendEOF();
+            std::list<std::string>& stringInput, StdioMode mode = StdioMode::Pipe) {
+        childProcess.setStdioMode(mode);
+        internal::startWithInput(childProcess, commandPath, commandArgs, stringInput);
     }
 
     ~ProcessStream() {
@@ -553,4 +1937,522 @@ public:
     }
 };
 
+
+#if SUBPROCESSCPP_HAS_COROUTINES
+/**
+ * Something that can resume coroutines once a file descriptor becomes ready.
+ * Implement this to drive AsyncProcess from an existing event loop (epoll,
+ * io_uring, asio, ...), or use PollEventLoop.
+ * */
+class EventLoop {
+public:
+    virtual ~EventLoop() = default;
+
+    /**
+     * resumes the handle once, after any of the poll events are reported on fd
+     * */
+    virtual void watch(int fd, short events, std::coroutine_handle<> handle) = 0;
+
+    /**
+     * resumes the handle once, after the delay has passed
+     * */
+    virtual void after(std::chrono::milliseconds delay, std::coroutine_handle<> handle) = 0;
+};
+
+template <typename T = void>
+class Task;
+
+namespace internal {
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept {
+            return false;
+        }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            // hand control back to whoever awaited us
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept {
+        return {};
+    }
+    FinalAwaiter final_suspend() noexcept {
+        return {};
+    }
+    void unhandled_exception() {
+        exception = std::current_exception();
+    }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    void return_value(T v) {
+        value = std::move(v);
+    }
+    T result() {
+        if (exception) std::rethrow_exception(exception);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() {
+        if (exception) std::rethrow_exception(exception);
+    }
+};
+
+/**
+ * suspends until a descriptor reports one of the poll events
+ * */
+struct FdReady {
+    EventLoop& loop;
+    int fd;
+    short events;
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> handle) {
+        loop.watch(fd, events, handle);
+    }
+    void await_resume() const noexcept {}
+};
+
+/**
+ * suspends for at least the given delay
+ * */
+struct Sleep {
+    EventLoop& loop;
+    std::chrono::milliseconds delay;
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> handle) {
+        loop.after(delay, handle);
+    }
+    void await_resume() const noexcept {}
+};
+}
+
+/**
+ * A lazily started coroutine producing a T, which runs when it is awaited
+ * (or when it is spawned onto a PollEventLoop).
+ * */
+template <typename T>
+class Task {
+public:
+    using promise_type = internal::TaskPromise<T>;
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+public:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    ~Task() {
+        if (handle) handle.destroy();
+    }
+
+    bool done() const {
+        return !handle || handle.done();
+    }
+
+    /**
+     * runs the task until its first suspension point, for top level tasks
+     * */
+    void start() {
+        handle.resume();
+    }
+
+    /**
+     * @return the value the task returned, rethrowing anything it threw.
+     * Only valid once done() is true.
+     * */
+    T result() {
+        return handle.promise().result();
+    }
+
+    auto operator co_await() noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() const noexcept {
+                return handle.done();
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            T await_resume() {
+                return handle.promise().result();
+            }
+        };
+        return Awaiter{handle};
+    }
+};
+
+namespace internal {
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+}
+
+/**
+ * An asynchronous sequence of values, consumed with
+ *     while (auto value = co_await generator.next()) { ... }
+ * */
+template <typename T>
+class AsyncGenerator {
+public:
+    struct promise_type {
+        std::optional<T> current;
+        std::coroutine_handle<> consumer;
+        std::exception_ptr exception;
+
+        struct TransferToConsumer {
+            bool await_ready() noexcept {
+                return false;
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                return handle.promise().consumer;
+            }
+            void await_resume() noexcept {}
+        };
+
+        AsyncGenerator get_return_object() {
+            return AsyncGenerator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        TransferToConsumer final_suspend() noexcept {
+            current.reset();
+            return {};
+        }
+        TransferToConsumer yield_value(T value) {
+            current = std::move(value);
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            exception = std::current_exception();
+        }
+    };
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+public:
+    explicit AsyncGenerator(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    AsyncGenerator(const AsyncGenerator&) = delete;
+    AsyncGenerator& operator=(const AsyncGenerator&) = delete;
+    AsyncGenerator(AsyncGenerator&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    ~AsyncGenerator() {
+        if (handle) handle.destroy();
+    }
+
+    /**
+     * @return an awaitable yielding the next value, or an empty optional once
+     * the generator has finished
+     * */
+    auto next() noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() const noexcept {
+                return handle.done();
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().consumer = awaiting;
+                return handle;
+            }
+            std::optional<T> await_resume() {
+                if (handle.promise().exception) std::rethrow_exception(handle.promise().exception);
+                return std::move(handle.promise().current);
+            }
+        };
+        return Awaiter{handle};
+    }
+};
+
+/**
+ * A single threaded EventLoop built on poll. Spawn any number of tasks onto
+ * it then call run, which returns once they have all finished.
+ * */
+class PollEventLoop : public EventLoop {
+    struct Watcher {
+        int fd;
+        short events;
+        std::coroutine_handle<> handle;
+    };
+    struct Timer {
+        std::chrono::steady_clock::time_point deadline;
+        std::coroutine_handle<> handle;
+    };
+
+    std::vector<Watcher> watchers;
+    std::vector<Timer> timers;
+    std::list<Task<void>> spawned;
+
+    /**
+     * drops finished top level tasks, rethrowing the first exception found
+     * */
+    void reapSpawned() {
+        for (auto it = spawned.begin(); it != spawned.end();) {
+            if (it->done()) {
+                Task<void> finished = std::move(*it);
+                it = spawned.erase(it);
+                finished.result();
+            } else {
+                ++it;
+            }
+        }
+    }
+
+public:
+    void watch(int fd, short events, std::coroutine_handle<> handle) override {
+        watchers.push_back({fd, events, handle});
+    }
+
+    void after(std::chrono::milliseconds delay, std::coroutine_handle<> handle) override {
+        timers.push_back({std::chrono::steady_clock::now() + delay, handle});
+    }
+
+    /**
+     * starts a task, which will be kept alive by the loop until it finishes
+     * */
+    void spawn(Task<void> task) {
+        spawned.push_back(std::move(task));
+        spawned.back().start();
+    }
+
+    /**
+     * resumes waiting coroutines until no spawned task is left waiting on anything
+     * @throws std::system_error if poll fails, and rethrows anything a spawned task threw
+     * */
+    void run() {
+        std::vector<struct pollfd> fds;
+        std::vector<std::coroutine_handle<>> ready;
+        while (true) {
+            reapSpawned();
+            if (watchers.empty() && timers.empty()) return;
+
+            long timeout = -1;
+            auto now = std::chrono::steady_clock::now();
+            for (const Timer& timer : timers) {
+                long ms = std::chrono::duration_cast<std::chrono::milliseconds>(timer.deadline - now).count();
+                ms = std::max(ms, 0L);
+                timeout = timeout < 0 ? ms : std::min(timeout, ms);
+            }
+
+            fds.clear();
+            for (const Watcher& watcher : watchers) {
+                fds.push_back({watcher.fd, watcher.events, 0});
+            }
+            if (poll(fds.data(), fds.size(), timeout) < 0) {
+                if (errno == EINTR) continue;
+                throw std::system_error(errno, std::generic_category(), "poll failed in PollEventLoop::run");
+            }
+
+            // collect everything that is ready before resuming anything, as
+            // resumed coroutines will register new watchers and timers
+            ready.clear();
+            size_t kept = 0;
+            for (size_t i = 0; i < watchers.size(); ++i) {
+                if (fds[i].revents != 0) {
+                    ready.push_back(watchers[i].handle);
+                } else {
+                    watchers[kept++] = watchers[i];
+                }
+            }
+            watchers.resize(kept);
+
+            now = std::chrono::steady_clock::now();
+            kept = 0;
+            for (size_t i = 0; i < timers.size(); ++i) {
+                if (timers[i].deadline <= now) {
+                    ready.push_back(timers[i].handle);
+                } else {
+                    timers[kept++] = timers[i];
+                }
+            }
+            timers.resize(kept);
+
+            for (std::coroutine_handle<> handle : ready) {
+                handle.resume();
+            }
+        }
+    }
+
+    /**
+     * runs a single task to completion
+     * @return the result of the task
+     * @throws std::logic_error if the task is left suspended on something
+     * this loop isn't waiting for
+     * */
+    template <typename T>
+    T run(Task<T> task) {
+        task.start();
+        run();
+        if (!task.done()) {
+            throw std::logic_error("task is still suspended but the event loop has nothing left to wait on");
+        }
+        return task.result();
+    }
+};
+
+/**
+ * A coroutine friendly Process. All of the operations suspend rather than
+ * block, so a single thread can serve any number of children.
+ * */
+class AsyncProcess {
+    EventLoop& loop;
+    internal::Process process;
+    int pidFileDescriptor = -1;
+    // started, and exit hasn't reaped it yet
+    bool running = false;
+
+public:
+    explicit AsyncProcess(EventLoop& loop) : loop(loop) {}
+    AsyncProcess(const AsyncProcess&) = delete;
+    AsyncProcess& operator=(const AsyncProcess&) = delete;
+
+    /**
+     * closes the pipes to the child, and kills and reaps it if exit
+     * wasn't awaited, so no descriptors or zombies outlive the object
+     * */
+    ~AsyncProcess() {
+        process.sendEOF();
+        process.closeInput();
+        if (pidFileDescriptor >= 0) close(pidFileDescriptor);
+        if (running) {
+            int status;
+            if (!process.tryWait(status)) {
+                kill(process.getPid(), SIGKILL);
+                process.waitUntilFinished();
+            }
+        }
+    }
+
+    /**
+     * see internal::Process::setStdioMode, must be called before start
+     * */
+    void setStdioMode(StdioMode mode) {
+        process.setStdioMode(mode);
+    }
+
+    /**
+     * starts the process, see internal::Process::start
+     * */
+    template <class InputIT>
+    void start(const std::string& commandPath, InputIT argsItBegin, InputIT argsItEnd) {
+        process.start(commandPath, argsItBegin, argsItEnd);
+        running = process.getPid() > 0;
+        int writeFd = process.getPipe().writeFileDescriptor();
+        fcntl(writeFd, F_SETFL, fcntl(writeFd, F_GETFL) | O_NONBLOCK);
+#ifdef SYS_pidfd_open
+        pidFileDescriptor = syscall(SYS_pidfd_open, process.getPid(), 0);
+#endif
+    }
+
+    pid_t getPid() const {
+        return process.getPid();
+    }
+
+    /**
+     * reads a line from the process's stdout
+     * @return the line including its newline, or the empty string at EOF
+     * */
+    Task<std::string> readLine() {
+        while (!process.isReady()) {
+            if (!process.isGood()) co_return std::string();
+            co_await internal::FdReady{loop, process.getPipe().readFileDescriptor(), POLLIN};
+        }
+        co_return process.readLine();
+    }
+
+    /**
+     * writes all of the buffer to the process's stdin
+     * @return the number of bytes written, which is short only if the pipe broke
+     * (e.g. the child exited), this never raises SIGPIPE
+     * */
+    Task<size_t> write(std::string buf) {
+        int fd = process.getPipe().writeFileDescriptor();
+        size_t written = 0;
+        while (written < buf.size()) {
+            ssize_t n = process.writeSome(buf.data() + written, buf.size() - written);
+            if (n >= 0) {
+                written += n;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await internal::FdReady{loop, fd, POLLOUT};
+            } else if (errno != EINTR) {
+                break;
+            }
+        }
+        co_return written;
+    }
+
+    void sendEOF() {
+        process.sendEOF();
+    }
+
+    /**
+     * waits for the process to exit and reaps it
+     * @return the exit status, as from waitpid
+     * */
+    Task<int> exit() {
+        int status;
+        while (!process.tryWait(status)) {
+            if (pidFileDescriptor >= 0) {
+                co_await internal::FdReady{loop, pidFileDescriptor, POLLIN};
+            } else {
+                // no pidfd on this kernel, fall back to checking periodically
+                co_await internal::Sleep{loop, std::chrono::milliseconds(10)};
+            }
+        }
+        running = false;
+        co_return status;
+    }
+
+    /**
+     * @return a generator over every line of the process's stdout
+     * */
+    AsyncGenerator<std::string> lines() {
+        while (true) {
+            std::string line = co_await readLine();
+            if (line.empty()) co_return;
+            co_yield std::move(line);
+        }
+    }
+};
+#endif  // SUBPROCESSCPP_HAS_COROUTINES
+
 }  // end namespace subprocess
@@ -4,11 +4,34 @@
  * Uses the Catch2 testing library (https://github.com/catchorg/Catch2)
  */
 
-#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#define CATCH_CONFIG_RUNNER  // we provide main(), so the binary can also act as a cooperating child
 #include "catch.hpp"
 
 #include "subprocess.hpp"
 
+#include <sys/resource.h>
+
+/* echo everything from the TEST_IN ring into the TEST_OUT ring, run by re-executing this binary */
+int ringEchoChild() {
+    subprocess::internal::SharedRing in = subprocess::internal::SharedRing::fromEnvironment("TEST_IN");
+    subprocess::internal::SharedRing out = subprocess::internal::SharedRing::fromEnvironment("TEST_OUT");
+    if (!in.isValid() || !out.isValid()) return 1;
+    std::vector<char> buf(1000);
+    size_t n;
+    while ((n = in.read(buf.data(), buf.size())) > 0) {
+        if (out.write(buf.data(), n) != n) return 1;
+    }
+    out.closeWriter();
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "--ring-echo") {
+        return ringEchoChild();
+    }
+    return Catch::Session().run(argc, argv);
+}
+
 TEST_CASE("basic echo execution", "[subprocess::execute]") {
     std::list<std::string> inputs;
     std::vector<std::string> outputs;
@@ -144,4 +167,478 @@ TEST_CASE("output iterator all operator overload testing", "[subprocess::Process
     REQUIRE(expectedOutput.size() == 0);
 }
 
+TEST_CASE("stdin larger than any pipe doesn't deadlock", "[subprocess::execute]") {
+    // cat stops reading stdin once its stdout fills, so output has to be drained while input
+    // is written. 4 MiB is beyond the default pipe-max-size, so no pipe could hold it all
+    std::string line(1023, 'x');
+    line += '\n';
+    std::list<std::string> inputs(4096, line);
+    size_t outputLines = 0;
+    int retval = subprocess::execute("/bin/cat", {}, inputs, [&](std::string s) {
+        REQUIRE(s == line);
+        outputLines++;
+    });
+
+    REQUIRE(retval == 0);
+    REQUIRE(outputLines == 4096);
+}
+
+TEST_CASE("shared ring transfers everything across wraparound", "[subprocess::internal::SharedRing]") {
+    subprocess::internal::SharedRing ring = subprocess::internal::SharedRing::create(4096);
+    REQUIRE(ring.isValid());
+
+    const size_t total = 1 << 20;
+    std::thread writer([&]() {
+        std::vector<char> buf(1000);
+        for (size_t sent = 0; sent < total; sent += buf.size()) {
+            size_t len = std::min(buf.size(), total - sent);
+            for (size_t i = 0; i < len; ++i) buf[i] = static_cast<char>((sent + i) % 251);
+            ring.write(buf.data(), len);
+        }
+        ring.closeWriter();
+    });
+
+    std::vector<char> buf(3000);
+    size_t received = 0;
+    bool inOrder = true;
+    size_t n;
+    while ((n = ring.read(buf.data(), buf.size())) > 0) {
+        for (size_t i = 0; i < n; ++i) inOrder &= buf[i] == static_cast<char>((received + i) % 251);
+        received += n;
+    }
+    writer.join();
+
+    REQUIRE(inOrder);
+    REQUIRE(received == total);
+}
+
+TEST_CASE("pty mode child sees a terminal", "[subprocess::internal::Process]") {
+    subprocess::internal::Process proc;
+    proc.setStdioMode(subprocess::StdioMode::Pty);
+    std::vector<std::string> args = {"-c", "test -t 1 && echo tty || echo notty"};
+    proc.start("/bin/sh", args.begin(), args.end());
+    proc.sendEOF();
+
+    REQUIRE(proc.readLine() == "tty\n");
+    // the closed pty must read as EOF rather than an error
+    REQUIRE(proc.readLine() == "");
+    REQUIRE(proc.waitUntilFinished() == 0);
+}
+
+TEST_CASE("pty mode output arrives before stdin closes", "[subprocess::internal::Process]") {
+    // grep fully buffers a pipe, but line buffers a terminal
+    subprocess::internal::Process proc;
+    proc.setStdioMode(subprocess::StdioMode::Pty);
+    std::vector<std::string> args = {"hello"};
+    proc.start("/bin/grep", args.begin(), args.end());
+
+    proc.write("hello, world\n");
+    REQUIRE(proc.readLine(std::chrono::duration<long>(5)) == "hello, world\n");
+    proc.write("goodbye, world\n");
+    proc.write("hello again\n");
+    REQUIRE(proc.readLine(std::chrono::duration<long>(5)) == "hello again\n");
+    proc.sendEOF();
+    REQUIRE(proc.readLine() == "");
+    REQUIRE(proc.waitUntilFinished() == 0);
+}
+
+TEST_CASE("pty mode output iterator", "[subprocess::ProcessStream]") {
+    std::list<std::string> inputs = {"12232\n", "hello, world\n", "Hello, world\n", "line: Hello, world!\n"};
+    subprocess::ProcessStream ps("/bin/grep", {"-i", "^Hello, world$"}, inputs, subprocess::StdioMode::Pty);
+    std::vector<std::string> expectedOutput = {"hello, world\n", "Hello, world\n"};
+    std::vector<std::string> outputs;
+    for (std::string out : ps) {
+        outputs.push_back(out);
+    }
+
+    REQUIRE(outputs == expectedOutput);
+}
+
+TEST_CASE("tab separated records are parsed into tuples", "[subprocess::executeRecords]") {
+    std::list<std::string> inputs = {"4\t./src\n", "-12\t./a file\n", "not a number\t./b\n", "7\n",
+            "1024\t./c\r\n"};
+    std::vector<std::pair<long, std::string>> outputs;
+    size_t malformed = 0;
+    typedef subprocess::Record<'\t', long, subprocess::StringRef> DuRecord;
+    int retval = subprocess::executeRecords<DuRecord>("/bin/cat", {}, inputs,
+            [&](const DuRecord::value_type& record) {
+                outputs.emplace_back(std::get<0>(record), std::get<1>(record).str());
+            },
+            &malformed);
+
+    REQUIRE(retval == 0);
+    REQUIRE(malformed == 2);
+    REQUIRE(outputs == std::vector<std::pair<long, std::string>>(
+                               {{4, "./src"}, {-12, "./a file"}, {1024, "./c"}}));
+}
+
+struct PsRow {
+    int pid;
+    double cpu;
+    subprocess::StringRef command;
+};
+
+TEST_CASE("space separated records are parsed into structs", "[subprocess::executeRecords]") {
+    // column aligned like ps, the last field takes the rest of the line
+    std::list<std::string> inputs = {"    1  0.0 /sbin/init splash\n", "  431 12.5 /usr/bin/bash  \n"};
+    std::vector<int> pids;
+    std::vector<double> cpus;
+    std::vector<std::string> commands;
+    typedef subprocess::StructRecord<PsRow, ' ', int, double, subprocess::StringRef> PsRecord;
+    int retval = subprocess::executeRecords<PsRecord>("/bin/cat", {}, inputs, [&](const PsRow& row) {
+        pids.push_back(row.pid);
+        cpus.push_back(row.cpu);
+        commands.push_back(row.command.str());
+    });
+
+    REQUIRE(retval == 0);
+    REQUIRE(pids == std::vector<int>({1, 431}));
+    REQUIRE(cpus == std::vector<double>({0.0, 12.5}));
+    REQUIRE(commands == std::vector<std::string>({"/sbin/init splash", "/usr/bin/bash"}));
+}
+
+TEST_CASE("record fields ignore the numeric locale", "[subprocess::Record]") {
+    typedef subprocess::Record<'\t', double> DecimalRecord;
+    DecimalRecord::tuple_type fields;
+    std::string line = "12.5";
+    // only changes anything where a comma decimal locale is installed
+    std::string previous = setlocale(LC_NUMERIC, nullptr);
+    setlocale(LC_NUMERIC, "de_DE.UTF-8");
+    bool parsed = DecimalRecord::parse(&line[0], &line[0] + line.size(), fields);
+    setlocale(LC_NUMERIC, previous.c_str());
+
+    REQUIRE(parsed);
+    REQUIRE(std::get<0>(fields) == 12.5);
+}
+
+TEST_CASE("record fields reject out of range and partial numbers", "[subprocess::Record]") {
+    typedef subprocess::Record<',', signed char, unsigned short, float> SmallRecord;
+    SmallRecord::tuple_type fields;
+    auto parse = [&](const std::string& line) { return SmallRecord::parse(&line[0], &line[0] + line.size(), fields); };
+
+    REQUIRE(parse("-128,65535,1.5"));
+    REQUIRE(std::get<0>(fields) == -128);
+    REQUIRE(std::get<1>(fields) == 65535);
+    REQUIRE(std::get<2>(fields) == 1.5f);
+    REQUIRE_FALSE(parse("-129,0,0"));
+    REQUIRE_FALSE(parse("0,65536,0"));
+    REQUIRE_FALSE(parse("0,-1,0"));
+    REQUIRE_FALSE(parse("0,1x,0"));
+    // only plain decimals, the same whichever standard library does the conversion
+    REQUIRE_FALSE(parse("0,1,0x10"));
+    REQUIRE_FALSE(parse("0,1,+2"));
+    REQUIRE_FALSE(parse("0,1,inf"));
+    REQUIRE_FALSE(parse("0,1,nan"));
+    REQUIRE_FALSE(parse("0,1,."));
+    REQUIRE_FALSE(parse("0,1,1e"));
+    REQUIRE_FALSE(parse("0,1,1e40"));
+    REQUIRE(parse("0,1,-.25e+1"));
+    REQUIRE(std::get<2>(fields) == -2.5f);
+    REQUIRE(parse("0,1,3."));
+    REQUIRE(std::get<2>(fields) == 3.0f);
+    REQUIRE_FALSE(parse("0,1, 2"));
+    REQUIRE_FALSE(parse("0,1"));
+    REQUIRE_FALSE(parse("0,1,2,3"));
+}
+
+TEST_CASE("traced lifecycle exports as chrome trace events", "[subprocess::trace]") {
+    subprocess::trace::enable();
+    std::list<std::string> inputs = {"henlo wurld\n"};
+    std::vector<std::string> outputs;
+    int retval = subprocess::execute("/bin/cat", {}, inputs, [&](std::string s) { outputs.push_back(s); });
+    std::list<std::string> noInputs;
+    int failedRetval = subprocess::execute("/bin/wangwang", {}, noInputs, [](std::string) {});
+    subprocess::trace::disable();
+
+    std::ostringstream json;
+    subprocess::trace::writeChromeTrace(json);
+    std::string trace = json.str();
+
+    REQUIRE(retval == 0);
+    REQUIRE(failedRetval != 0);
+    REQUIRE(outputs.size() == 1);
+    REQUIRE(trace.find("{\"traceEvents\":[") == 0);
+    for (std::string name : {"spawn", "exec", "write", "first byte", "read", "eof", "wait", "exit"}) {
+        INFO(name);
+        REQUIRE(trace.find("\"name\":\"" + name + "\"") != std::string::npos);
+    }
+    REQUIRE(trace.find("\"name\":\"exec failed\"") != std::string::npos);
+    REQUIRE(trace.find("\"errno\":" + std::to_string(ENOENT)) != std::string::npos);
+    REQUIRE(trace.find("\"bytes\":12") != std::string::npos);
+}
+
+TEST_CASE("clearing the trace forgets events and frees exited threads' buffers", "[subprocess::trace]") {
+    subprocess::internal::TraceRegistry& registry = subprocess::internal::traceRegistry();
+    subprocess::trace::enable();
+    subprocess::trace::clear();
+    size_t buffersBefore = registry.buffers.size();
+    for (int i = 0; i < 10; ++i) {
+        std::list<std::string> inputs = {"henlo wurld\n"};
+        // each runs on a thread of its own, which has exited once get returns
+        REQUIRE(subprocess::async("/bin/cat", {}, inputs, [](std::string) {}).get() == 0);
+    }
+    subprocess::trace::disable();
+
+    // every thread reused the buffer of the one before it
+    REQUIRE(registry.buffers.size() <= buffersBefore + 1);
+    std::ostringstream before;
+    subprocess::trace::writeChromeTrace(before);
+    REQUIRE(before.str().find("\"name\":\"spawn\"") != std::string::npos);
+
+    subprocess::trace::clear();
+    REQUIRE(registry.buffers.size() <= buffersBefore);
+    std::ostringstream after;
+    subprocess::trace::writeChromeTrace(after);
+    REQUIRE(after.str().find("\"name\"") == std::string::npos);
+}
+
+TEST_CASE("shared rings round trip through a cooperating child", "[subprocess::internal::SharedRing]") {
+    subprocess::internal::SharedRing in = subprocess::internal::SharedRing::create(4096);
+    subprocess::internal::SharedRing out = subprocess::internal::SharedRing::create(8192);
+    REQUIRE(in.isValid());
+    REQUIRE(out.isValid());
+    subprocess::internal::Process proc;
+    proc.shareRing("TEST_IN", in);
+    proc.shareRing("TEST_OUT", out);
+    std::vector<std::string> args = {"--ring-echo"};
+    proc.start("/proc/self/exe", args.begin(), args.end());
+
+    const size_t total = 1 << 20;
+    std::thread writer([&]() {
+        std::vector<char> buf(777);
+        for (size_t sent = 0; sent < total; sent += buf.size()) {
+            size_t len = std::min(buf.size(), total - sent);
+            for (size_t i = 0; i < len; ++i) buf[i] = static_cast<char>((sent + i) % 251);
+            in.write(buf.data(), len);
+        }
+        in.closeWriter();
+    });
+
+    std::vector<char> buf(3000);
+    size_t received = 0;
+    bool inOrder = true;
+    size_t n;
+    while ((n = out.read(buf.data(), buf.size())) > 0) {
+        for (size_t i = 0; i < n; ++i) inOrder &= buf[i] == static_cast<char>((received + i) % 251);
+        received += n;
+    }
+    writer.join();
+
+    REQUIRE(inOrder);
+    REQUIRE(received == total);
+    REQUIRE(proc.waitUntilFinished() == 0);
+}
+
+TEST_CASE("shared rings replace inherited variables of the same name", "[subprocess::internal::SharedRing]") {
+    // as a cooperating process that was itself handed a ring would have
+    setenv("TEST_IN", "999:998:997:1", 1);
+    setenv("TEST_OUT", "996:995:994:1", 1);
+    subprocess::internal::SharedRing in = subprocess::internal::SharedRing::create(4096);
+    subprocess::internal::SharedRing out = subprocess::internal::SharedRing::create(4096);
+    subprocess::internal::Process proc;
+    proc.shareRing("TEST_IN", in);
+    proc.shareRing("TEST_OUT", out);
+    std::vector<std::string> args = {"--ring-echo"};
+    proc.start("/proc/self/exe", args.begin(), args.end());
+    unsetenv("TEST_IN");
+    unsetenv("TEST_OUT");
+
+    std::string sent = "henlo wurld";
+    REQUIRE(in.write(sent.data(), sent.size()) == sent.size());
+    in.closeWriter();
+    std::string received;
+    char buf[64];
+    size_t n;
+    while ((n = out.read(buf, sizeof(buf))) > 0) received.append(buf, n);
+
+    REQUIRE(received == sent);
+    REQUIRE(proc.waitUntilFinished() == 0);
+}
+
+TEST_CASE("shared ring writes return short once the reader exits", "[subprocess::internal::SharedRing]") {
+    subprocess::internal::SharedRing ring = subprocess::internal::SharedRing::create(4096);
+    subprocess::internal::Process proc;
+    proc.shareRing("TEST_RING", ring);
+    std::vector<std::string> args;
+    proc.start("/bin/true", args.begin(), args.end());
+    REQUIRE(proc.waitUntilFinished() == 0);
+
+    // like writing to a pipe with no reader, rather than blocking forever
+    std::vector<char> buf(10000, 'x');
+    REQUIRE(ring.write(buf.data(), buf.size()) == 4096);
+    REQUIRE(ring.peerExited());
+}
+
+TEST_CASE("shared ring reads see EOF once the writer exits", "[subprocess::internal::SharedRing]") {
+    subprocess::internal::SharedRing ring = subprocess::internal::SharedRing::create(4096);
+    subprocess::internal::Process proc;
+    proc.shareRing("TEST_RING", ring);
+    std::vector<std::string> args;
+    proc.start("/bin/true", args.begin(), args.end());
+    REQUIRE(proc.waitUntilFinished() == 0);
+
+    char buf[16];
+    REQUIRE(ring.read(buf, sizeof(buf)) == 0);
+    REQUIRE(ring.peerExited());
+}
+
+TEST_CASE("shared ring writes return short once the reader closes", "[subprocess::internal::SharedRing]") {
+    subprocess::internal::SharedRing ring = subprocess::internal::SharedRing::create(4096);
+    std::vector<char> buf(10000, 'x');
+    std::thread reader([&]() {
+        char readBuf[100];
+        ring.read(readBuf, sizeof(readBuf));
+        ring.closeReader();
+    });
+    size_t written = ring.write(buf.data(), buf.size());
+    reader.join();
+
+    REQUIRE(written < buf.size());
+    REQUIRE(ring.write(buf.data(), buf.size()) == 0);
+}
+
+#if SUBPROCESSCPP_HAS_COROUTINES
+TEST_CASE("coroutine ping pong with cat", "[subprocess::AsyncProcess]") {
+    subprocess::PollEventLoop loop;
+    subprocess::AsyncProcess proc(loop);
+    std::vector<std::string> args;
+    proc.start("/bin/cat", args.begin(), args.end());
+
+    std::vector<std::string> outputs;
+    auto session = [&]() -> subprocess::Task<int> {
+        co_await proc.write("henlo wurld\n");
+        outputs.push_back(co_await proc.readLine());
+        co_await proc.write("1,2,3,4\n");
+        outputs.push_back(co_await proc.readLine());
+        proc.sendEOF();
+        outputs.push_back(co_await proc.readLine());
+        co_return co_await proc.exit();
+    };
+
+    REQUIRE(loop.run(session()) == 0);
+    REQUIRE(outputs == std::vector<std::string>({"henlo wurld\n", "1,2,3,4\n", ""}));
+}
+
+TEST_CASE("coroutine write after the child exited returns short", "[subprocess::AsyncProcess]") {
+    subprocess::PollEventLoop loop;
+    subprocess::AsyncProcess proc(loop);
+    std::vector<std::string> args;
+    proc.start("/bin/true", args.begin(), args.end());
+
+    // must not raise SIGPIPE, which would take down every other child on the loop too
+    int status = -1;
+    auto session = [&]() -> subprocess::Task<size_t> {
+        status = co_await proc.exit();
+        co_return co_await proc.write("hello\n");
+    };
+
+    REQUIRE(loop.run(session()) == 0);
+    REQUIRE(status == 0);
+}
+
+TEST_CASE("coroutine writes are traced", "[subprocess::AsyncProcess]") {
+    subprocess::trace::enable();
+    subprocess::trace::clear();
+    subprocess::PollEventLoop loop;
+    subprocess::AsyncProcess proc(loop);
+    std::vector<std::string> args;
+    proc.start("/bin/cat", args.begin(), args.end());
+
+    auto session = [&]() -> subprocess::Task<int> {
+        co_await proc.write("ping\n");
+        proc.sendEOF();
+        while (!(co_await proc.readLine()).empty()) {
+        }
+        co_return co_await proc.exit();
+    };
+    REQUIRE(loop.run(session()) == 0);
+    subprocess::trace::disable();
+
+    std::ostringstream json;
+    subprocess::trace::writeChromeTrace(json);
+    std::string write = "\"name\":\"write\"";
+    size_t found = json.str().find(write);
+    REQUIRE(found != std::string::npos);
+    std::string event = json.str().substr(found, json.str().find('}', found) - found);
+    REQUIRE(event.find("\"tid\":" + std::to_string(proc.getPid())) != std::string::npos);
+    REQUIRE(event.find("\"bytes\":5") != std::string::npos);
+}
+
+TEST_CASE("finished coroutine children give back their descriptors", "[subprocess::AsyncProcess]") {
+    struct rlimit original;
+    REQUIRE(getrlimit(RLIMIT_NOFILE, &original) == 0);
+    struct rlimit lowered = original;
+    lowered.rlim_cur = 64;
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+
+    // a few descriptors per child, so any leak runs out long before the end
+    std::vector<pid_t> abandoned;
+    int finished = 0;
+    for (int i = 0; i < 200; ++i) {
+        subprocess::PollEventLoop loop;
+        subprocess::AsyncProcess proc(loop);
+        std::vector<std::string> args;
+        proc.start("/bin/cat", args.begin(), args.end());
+        if (i % 2 == 0) {
+            auto session = [&]() -> subprocess::Task<int> {
+                co_await proc.write("hello\n");
+                proc.sendEOF();
+                while (!(co_await proc.readLine()).empty()) {
+                }
+                co_return co_await proc.exit();
+            };
+            if (loop.run(session()) == 0) finished++;
+        } else {
+            // left running, the destructor has to kill and reap it
+            abandoned.push_back(proc.getPid());
+        }
+    }
+    setrlimit(RLIMIT_NOFILE, &original);
+
+    REQUIRE(finished == 100);
+    for (pid_t pid : abandoned) {
+        int status;
+        REQUIRE(waitpid(pid, &status, WNOHANG) == -1);
+    }
+}
+
+TEST_CASE("running a task that can never finish throws", "[subprocess::PollEventLoop]") {
+    subprocess::PollEventLoop loop;
+    auto stuck = []() -> subprocess::Task<int> {
+        // suspends without asking the loop to resume it
+        co_await std::suspend_always{};
+        co_return 1;
+    };
+
+    REQUIRE_THROWS_AS(loop.run(stuck()), std::logic_error);
+}
+
+TEST_CASE("coroutine line generator over many children", "[subprocess::AsyncProcess]") {
+    subprocess::PollEventLoop loop;
+    std::vector<std::string> outputs;
+    std::list<subprocess::AsyncProcess> procs;
+
+    std::vector<int> statuses;
+    for (int i = 0; i < 50; ++i) {
+        procs.emplace_back(loop);
+        std::vector<std::string> args = {"-e", std::to_string(i) + "\\nend"};
+        procs.back().start("/bin/echo", args.begin(), args.end());
+        subprocess::AsyncProcess& proc = procs.back();
+        loop.spawn([](subprocess::AsyncProcess& proc, std::vector<std::string>& outputs,
+                           std::vector<int>& statuses) -> subprocess::Task<> {
+            auto lines = proc.lines();
+            while (auto line = co_await lines.next()) {
+                outputs.push_back(*line);
+            }
+            statuses.push_back(co_await proc.exit());
+        }(proc, outputs, statuses));
+    }
+    loop.run();
+
+    REQUIRE(statuses == std::vector<int>(50, 0));
+    REQUIRE(outputs.size() == 100);
+    REQUIRE(std::count(outputs.begin(), outputs.end(), "end\n") == 50);
+}
+#endif
+
 // TODO: write more test cases (this seems pretty covering, let's see how coverage looks)